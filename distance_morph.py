@@ -5,6 +5,7 @@ will also read in similarity dataset and compute Spearman coefficient
 
 import sys
 import numpy as np
+from npy_model import load_npy_model
 
 max_size = 2000         # max length of strings
 N = 40                  # number of closest words that will be shown
@@ -13,6 +14,7 @@ max_w = 50              # max length of vocabulary entries
 if len(sys.argv) < 3:
 	print "Usage: python distance_morph.py <FILE> <word or word+lemma or lemma>"
 	print "where FILE contains word projections in the BINARY FORMAT,"
+	print "or is the .json index of a model saved with word2vec_morph -output-npy,"
 	print "word compares just the word embedding,"
 	print "and word+lemma compares the word embedding concatenated with a weighted average of its lemma vectors"
 
@@ -20,7 +22,6 @@ if len(sys.argv) < 3:
 	exit(0)
 file_name = sys.argv[1]
 word_lemma_opt = sys.argv[2]
-f = open(file_name, "rb")
 
 line_index = 0
 words = 0
@@ -33,50 +34,56 @@ bi = np.zeros(100, dtype=int)
 M = None
 vec = None
 b = 0
-for line in f:
+if file_name.endswith(".json"):
+	vocab, M = load_npy_model(file_name, word_lemma_opt)
+	words = len(vocab)
+	size = M.shape[1]
+else:
+	f = open(file_name, "rb")
+	for line in f:
 
-	fields = line.split()
+		fields = line.split()
 
-	# Grab the numbers from the header of the file
-	if line_index == 0:
-		header_nums = [int(x) for x in fields]
-		words = header_nums[0]
-		size = header_nums[1]
-		M = np.zeros((words, size))
-		if word_lemma_opt != "word+lemma":
-			if len(header_nums) < 3:
-				sys.exit("Passed a file with not enough header arguments")
-			word_size = header_nums[2]
-		line_index += 1	
-		continue
+		# Grab the numbers from the header of the file
+		if line_index == 0:
+			header_nums = [int(x) for x in fields]
+			words = header_nums[0]
+			size = header_nums[1]
+			M = np.zeros((words, size))
+			if word_lemma_opt != "word+lemma":
+				if len(header_nums) < 3:
+					sys.exit("Passed a file with not enough header arguments")
+				word_size = header_nums[2]
+			line_index += 1	
+			continue
 
-	vocab.append(fields[0])
+		vocab.append(fields[0])
 
-	# read in vector
-	float_fields = [float(x) for x in fields[1:]]
+		# read in vector
+		float_fields = [float(x) for x in fields[1:]]
 	
-	# if we only want to compare word, stop at word_size, fill the rest with zero
-	if word_lemma_opt == "word":
-		for a in xrange(size):
-			if a >= word_size:
-				float_fields[a] = 0.0
+		# if we only want to compare word, stop at word_size, fill the rest with zero
+		if word_lemma_opt == "word":
+			for a in xrange(size):
+				if a >= word_size:
+					float_fields[a] = 0.0
 
-	# if we only want to compare lemma, fill with zero until word_size
-	if word_lemma_opt == "lemma":
-		for a in xrange(size):
-			if a < word_size:
-				float_fields[a] = 0.0
+		# if we only want to compare lemma, fill with zero until word_size
+		if word_lemma_opt == "lemma":
+			for a in xrange(size):
+				if a < word_size:
+					float_fields[a] = 0.0
 
-	M[b] = float_fields
+		M[b] = float_fields
 
-	# normalize
-	Z = np.linalg.norm(M[b])
-	M[b] /= Z
+		# normalize
+		Z = np.linalg.norm(M[b])
+		M[b] /= Z
 
-	line_index += 1
-	b += 1
+		line_index += 1
+		b += 1
 
-f.close()
+	f.close()
 
 while True:
 	for a in xrange(N):
@@ -5,6 +5,7 @@ will also read in analogies dataset and compute accuracy
 
 import sys
 import numpy as np
+from npy_model import load_npy_model
 
 def read_in_analogies(filename):
 
@@ -32,6 +33,7 @@ def main():
 	if len(sys.argv) < 5:
 		print "Usage: python distance_morph_analogies.py <FILE> <word or word+lemma> <analogies file> <N>"
 		print "where FILE contains word projections in the BINARY FORMAT,"
+		print "or is the .json index of a model saved with word2vec_morph -output-npy,"
 		print "word compares just the word embedding,"
 		print "and word+lemma compares the word embedding concatenated with a weighted average of its lemma vectors"
 		print "and analogies file contains white-space-separated pairs of words in a relationship"
@@ -43,7 +45,6 @@ def main():
 	analogies_file = sys.argv[3]
 
 	analogies = read_in_analogies(analogies_file)
-	f = open(file_name, 'r')
 	print "Read in analogies"
 
 	N = int(sys.argv[4])
@@ -62,53 +63,59 @@ def main():
 	b = 0
 	M = None
 	vec = None
-	for line in f:
-
-		fields = line.split()
-
-		# Grab the numbers from the header of the file
-		if line_index == 0:
-			header_nums = [int(x) for x in fields]
-			words = header_nums[0]
-			size = header_nums[1]
-			M = np.zeros((words, size))
-			if word_lemma_opt != "word+lemma":
-				if len(header_nums) < 3:
-					sys.exit("Passed a file with not enough header arguments")
-				word_size = header_nums[2]
-			line_index += 1	
-			continue
+	if file_name.endswith(".json"):
+		vocab, M = load_npy_model(file_name, word_lemma_opt)
+		words = len(vocab)
+		size = M.shape[1]
+	else:
+		f = open(file_name, 'r')
+		for line in f:
+
+			fields = line.split()
+
+			# Grab the numbers from the header of the file
+			if line_index == 0:
+				header_nums = [int(x) for x in fields]
+				words = header_nums[0]
+				size = header_nums[1]
+				M = np.zeros((words, size))
+				if word_lemma_opt != "word+lemma":
+					if len(header_nums) < 3:
+						sys.exit("Passed a file with not enough header arguments")
+					word_size = header_nums[2]
+				line_index += 1	
+				continue
 
-		vocab.append(fields[0])
+			vocab.append(fields[0])
 
-		# read in vector
-		float_fields = [float(x) for x in fields[1:]]
+			# read in vector
+			float_fields = [float(x) for x in fields[1:]]
 
-		# if we only want to compare word, stop at word_size, fill the rest with zero
-		if word_lemma_opt == "word":
-			for a in xrange(size):
-				if a >= word_size:
-					float_fields[a] = 0.0
+			# if we only want to compare word, stop at word_size, fill the rest with zero
+			if word_lemma_opt == "word":
+				for a in xrange(size):
+					if a >= word_size:
+						float_fields[a] = 0.0
 
-		# if we only want to compare lemma, fill with zero until word_size
-		if word_lemma_opt == "lemma":
-			for a in xrange(size):
-				if a < word_size:
-					float_fields[a] = 0.0
+			# if we only want to compare lemma, fill with zero until word_size
+			if word_lemma_opt == "lemma":
+				for a in xrange(size):
+					if a < word_size:
+						float_fields[a] = 0.0
 
-		M[b] = float_fields
+			M[b] = float_fields
 
-		# normalize
-		Z = np.linalg.norm(M[b])
-		if Z < 0.0000001:
-			print M[b]
-			exit(0)
-		M[b] /= Z
+			# normalize
+			Z = np.linalg.norm(M[b])
+			if Z < 0.0000001:
+				print M[b]
+				exit(0)
+			M[b] /= Z
 
-		line_index += 1
-		b += 1
+			line_index += 1
+			b += 1
 
-	f.close()
+		f.close()
 
 	num_correct = 0
 	analogy_index = 0
@@ -135,7 +142,7 @@ def main():
 			vec1 = M[b1]
 			Z = np.linalg.norm(vec1)
 			if Z != 0.0:
-				vec1 /= Z
+				vec1 = vec1 / Z
 
 			try:
 				b2 = vocab.index(word2)
@@ -149,7 +156,7 @@ def main():
 			vec2 = M[b2]
 			Z = np.linalg.norm(vec2)
 			if Z != 0.0:
-				vec2 /= Z
+				vec2 = vec2 / Z
 
 			avg_diff += vec2 - vec1
 
@@ -173,7 +180,7 @@ def main():
 		vec3 = M[b3]
 		Z = np.linalg.norm(vec3)
 		if Z != 0.0:
-			vec3 /= Z
+			vec3 = vec3 / Z
 
 		for a in xrange(N):
 			bestd.append(0)
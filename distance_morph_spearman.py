@@ -5,6 +5,7 @@ will also read in similarity dataset and compute Spearman coefficient
 
 import sys
 import numpy as np
+from npy_model import load_npy_model
 import csv
 from scipy.stats import spearmanr
 
@@ -29,6 +30,7 @@ def main():
 	if len(sys.argv) < 4:
 		print "Usage: python distance_morph_spearman.py <FILE> <word or word+lemma> <comparison file>"
 		print "where FILE contains word projections in the BINARY FORMAT,"
+		print "or is the .json index of a model saved with word2vec_morph -output-npy,"
 		print "word compares just the word embedding,"
 		print "and word+lemma compares the word embedding concatenated with a weighted average of its lemma vectors"
 		print "and comparison file is an MC-style word similarity file to calculate spearman correlation with"
@@ -39,7 +41,6 @@ def main():
 	mc_file = sys.argv[3]
 
 	similarity_scores, word_pairs = read_in_MC_dataset(mc_file)
-	f = open(file_name, "rb")
 
 	num_oovs = 0
 	line_index = 0
@@ -52,51 +53,57 @@ def main():
 	M = None
 	vec = None
 	b = 0
-	for line in f:
-
-		fields = line.split()
-
-		# Grab the numbers from the header of the file
-		if line_index == 0:
-			header_nums = [int(x) for x in fields]
-			words = header_nums[0] + len(word_pairs)
-			size = header_nums[1]
-			M = np.zeros((words, size))
-			if word_lemma_opt != "word+lemma":
-				if len(header_nums) < 3:
-					sys.exit("Passed a file with not enough header arguments")
-				word_size = header_nums[2]
-			line_index += 1	
-			continue
-
-		vocab.append(fields[0])
-
-		# read in vector
-		float_fields = [float(x) for x in fields[1:]]
-
-		# if we only want to compare word, stop at word_size, fill the rest with zero
-		if word_lemma_opt == "word":
-			for a in xrange(size):
-				if a >= word_size:
-					float_fields[a] = 0.0
-
-		# if we only want to compare lemma, fill with zero until word_size
-		if word_lemma_opt == "lemma":
-			for a in xrange(size):
-				if a < word_size:
-					float_fields[a] = 0.0
-
-		M[b] = float_fields
-
-		# normalize
-		Z = np.linalg.norm(M[b])
-		if Z >= 0.0000001:
-			M[b] /= Z
-
-		line_index += 1
-		b += 1
-
-	f.close()
+	if file_name.endswith(".json"):
+		vocab, M = load_npy_model(file_name, word_lemma_opt)
+		words = len(vocab)
+		size = M.shape[1]
+	else:
+		f = open(file_name, "rb")
+		for line in f:
+
+			fields = line.split()
+
+			# Grab the numbers from the header of the file
+			if line_index == 0:
+				header_nums = [int(x) for x in fields]
+				words = header_nums[0] + len(word_pairs)
+				size = header_nums[1]
+				M = np.zeros((words, size))
+				if word_lemma_opt != "word+lemma":
+					if len(header_nums) < 3:
+						sys.exit("Passed a file with not enough header arguments")
+					word_size = header_nums[2]
+				line_index += 1	
+				continue
+
+			vocab.append(fields[0])
+
+			# read in vector
+			float_fields = [float(x) for x in fields[1:]]
+
+			# if we only want to compare word, stop at word_size, fill the rest with zero
+			if word_lemma_opt == "word":
+				for a in xrange(size):
+					if a >= word_size:
+						float_fields[a] = 0.0
+
+			# if we only want to compare lemma, fill with zero until word_size
+			if word_lemma_opt == "lemma":
+				for a in xrange(size):
+					if a < word_size:
+						float_fields[a] = 0.0
+
+			M[b] = float_fields
+
+			# normalize
+			Z = np.linalg.norm(M[b])
+			if Z >= 0.0000001:
+				M[b] /= Z
+
+			line_index += 1
+			b += 1
+
+		f.close()
 
 	similarity_scores_est = {}
 
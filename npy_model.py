@@ -0,0 +1,52 @@
+'''
+loads models saved with word2vec_morph -output-npy, for the distance_morph scripts
+'''
+
+import os
+import json
+import numpy as np
+
+norm_block = 65536      # rows per block when computing the row norms
+
+class NpyModel(object):
+	'''
+	the word vectors of a model, memory-mapped as float32 and never copied;
+	a row is masked to the word or lemma part and scaled to unit length when it is read
+	'''
+	def __init__(self, W, word_size, word_lemma_opt, normalized):
+		self.W = W
+		self.shape = W.shape
+		self.lo = 0
+		self.hi = W.shape[1]
+		# if we only want to compare word, skip the lemma part, and the other way round
+		if word_lemma_opt == "word":
+			self.hi = word_size
+		if word_lemma_opt == "lemma":
+			self.lo = word_size
+		if normalized and self.lo == 0 and self.hi == W.shape[1]:
+			# rows saved with -normalize 2 are unit length already
+			self.scale = np.ones(W.shape[0], dtype=np.float32)
+			return
+		Z = np.empty(W.shape[0])
+		for a in xrange(0, W.shape[0], norm_block):
+			Z[a:a + norm_block] = np.linalg.norm(W[a:a + norm_block, self.lo:self.hi].astype(float), axis=1)
+		Z[Z < 0.0000001] = 1.0
+		self.scale = 1.0 / Z
+
+	def __len__(self):
+		return self.shape[0]
+
+	def __getitem__(self, b):
+		row = np.zeros(self.shape[1])
+		row[self.lo:self.hi] = self.W[b, self.lo:self.hi] * self.scale[b]
+		return row
+
+def load_npy_model(index_file, word_lemma_opt):
+	'''
+	loads a model through its .json index; returns the vocabulary and the rows as an NpyModel
+	'''
+	index = json.load(open(index_file))
+	base = os.path.dirname(index_file)
+	W = np.load(os.path.join(base, index["words_file"]), mmap_mode='r')
+	vocab = np.load(os.path.join(base, index["vocab_file"]), mmap_mode='r').tolist()
+	return vocab, NpyModel(W, index["word_size"], word_lemma_opt, index["normalize"] == 2)
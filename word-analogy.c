@@ -16,10 +16,69 @@
 #include <string.h>
 #include <math.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 const long long max_size = 2000;         // max length of strings
 const long long N = 40;                  // number of closest words that will be shown
 const long long max_w = 50;              // max length of vocabulary entries
+#define R 400                            // candidates of a quantized scan that are rescored in float
+
+// Header of the container written by word2vec_morph -output-model; offsets are bytes from the start of the file
+struct model_file_header {
+  char magic[8];
+  long long version, words, lemmas, word_size, lemma_size, pairs;
+  long long word_vectors, lemma_vectors, average_vectors;
+  long long word_norms, average_norms;
+  long long word_names, lemma_names, strings;
+  long long pair_start, pair_lemma, pair_weight;
+  long long bytes;
+  long long quant_word, quant_average, quant_scales;
+};
+
+// Maps a model container; returns NULL if the file is not one
+char *MapModel(char *file_name) {
+  struct model_file_header *h;
+  struct stat st;
+  char *base;
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) != 0 || st.st_size < (long long)sizeof(struct model_file_header)) {
+    if (fd != -1) close(fd);
+    return NULL;
+  }
+  base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) return NULL;
+  h = (struct model_file_header *)base;
+  if (memcmp(h->magic, "W2VMMOD", 8) != 0 || h->version < 1 || h->version > 2 || h->bytes > st.st_size) {
+    munmap(base, st.st_size);
+    return NULL;
+  }
+  return base;
+}
+
+// Quantizes the query like word2vec_morph -quantize does the rows, to int8 with a scale of its own
+float QuantizeQuery(float *vec, long long size, signed char *q) {
+  long long a;
+  float max = 0;
+  for (a = 0; a < size; a++) if (fabs(vec[a]) > max) max = fabs(vec[a]);
+  if (max == 0) {
+    memset(q, 0, size);
+    return 0;
+  }
+  for (a = 0; a < size; a++) q[a] = (signed char)lrintf(vec[a] * 127 / max);
+  return max / 127;
+}
+
+// Plain loop on purpose: at -O3 -march=native it becomes integer SIMD multiply-adds
+static inline int Dot8(const signed char *x, const signed char *y, long long size) {
+  long long a;
+  int sum = 0;
+  for (a = 0; a < size; a++) sum += x[a] * y[a];
+  return sum;
+}
 
 int main(int argc, char **argv) {
   FILE *f;
@@ -28,41 +87,79 @@ int main(int argc, char **argv) {
   char file_name[max_size], st[100][max_size];
   float dist, len, bestd[N], vec[max_size];
   long long words, size, a, b, c, d, cn, bi[100];
-  float *M;
-  char *vocab;
+  float *M, *W, *A = NULL, *scale = NULL, *word_norms, *average_norms;
+  long long w_cols, a_cols = 0, *names, cand[R], candidates, worst = 0, e;
+  char *vocab, **word_names, *model;
+  signed char *QW = NULL, *QA = NULL, qvec[max_size];
+  float *QS = NULL, qw_scale, qa_scale, cand_d[R];
+  struct model_file_header *h;
   if (argc < 2) {
-    printf("Usage: ./word-analogy <FILE>\nwhere FILE contains word projections in the BINARY FORMAT\n");
+    printf("Usage: ./word-analogy <FILE> [float]\nwhere FILE contains word projections in the BINARY FORMAT\n");
+    printf("or is a model container saved by word2vec_morph -output-model, compared as words with lemma averages.\n");
+    printf("A container saved with -quantize is scanned in int8 and the best %d candidates are rescored in float,\n", R);
+    printf("unless float is given\n");
     return 0;
   }
   strcpy(file_name, argv[1]);
-  f = fopen(file_name, "rb");
-  if (f == NULL) {
-    printf("Input file not found\n");
-    return -1;
-  }
-  fscanf(f, "%lld", &words);
-  fscanf(f, "%lld", &size);
-  vocab = (char *)malloc((long long)words * max_w * sizeof(char));
-  M = (float *)malloc((long long)words * (long long)size * sizeof(float));
-  if (M == NULL) {
-    printf("Cannot allocate memory: %lld MB    %lld  %lld\n", (long long)words * size * sizeof(float) / 1048576, words, size);
-    return -1;
-  }
-  for (b = 0; b < words; b++) {
-    a = 0;
-    while (1) {
-      vocab[b * max_w + a] = fgetc(f);
-      if (feof(f) || (vocab[b * max_w + a] == ' ')) break;
-      if ((a < max_w) && (vocab[b * max_w + a] != '\n')) a++;
+  model = MapModel(file_name);
+  if (model != NULL) {
+    // The container is used in place: rows are scaled by the stored norms instead of being normalized
+    h = (struct model_file_header *)model;
+    words = h->words;
+    w_cols = h->word_size;
+    a_cols = h->lemma_size;
+    W = (float *)(model + h->word_vectors);
+    A = (float *)(model + h->average_vectors);
+    if (h->quant_word != 0 && !(argc > 2 && !strcmp(argv[2], "float"))) {
+      QW = (signed char *)(model + h->quant_word);
+      QA = (signed char *)(model + h->quant_average);
+      QS = (float *)(model + h->quant_scales);
     }
-    vocab[b * max_w + a] = 0;
-    for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
-    len = 0;
-    for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
-    len = sqrt(len);
-    for (a = 0; a < size; a++) M[a + b * size] /= len;
+    word_norms = (float *)(model + h->word_norms);
+    average_norms = (float *)(model + h->average_norms);
+    names = (long long *)(model + h->word_names);
+    word_names = (char **)malloc(words * sizeof(char *));
+    scale = (float *)malloc(words * sizeof(float));
+    for (b = 0; b < words; b++) {
+      word_names[b] = model + h->strings + names[b];
+      len = word_norms[b] * word_norms[b] + average_norms[b] * average_norms[b];
+      scale[b] = len > 0 ? 1 / sqrt(len) : 0;
+    }
+  } else {
+    f = fopen(file_name, "rb");
+    if (f == NULL) {
+      printf("Input file not found\n");
+      return -1;
+    }
+    fscanf(f, "%lld", &words);
+    fscanf(f, "%lld", &size);
+    vocab = (char *)malloc((long long)words * max_w * sizeof(char));
+    M = (float *)malloc((long long)words * (long long)size * sizeof(float));
+    if (M == NULL) {
+      printf("Cannot allocate memory: %lld MB    %lld  %lld\n", (long long)words * size * sizeof(float) / 1048576, words, size);
+      return -1;
+    }
+    for (b = 0; b < words; b++) {
+      a = 0;
+      while (1) {
+        vocab[b * max_w + a] = fgetc(f);
+        if (feof(f) || (vocab[b * max_w + a] == ' ')) break;
+        if ((a < max_w) && (vocab[b * max_w + a] != '\n')) a++;
+      }
+      vocab[b * max_w + a] = 0;
+      for (a = 0; a < size; a++) fread(&M[a + b * size], sizeof(float), 1, f);
+      len = 0;
+      for (a = 0; a < size; a++) len += M[a + b * size] * M[a + b * size];
+      len = sqrt(len);
+      for (a = 0; a < size; a++) M[a + b * size] /= len;
+    }
+    fclose(f);
+    W = M;
+    w_cols = size;
+    word_names = (char **)malloc(words * sizeof(char *));
+    for (b = 0; b < words; b++) word_names[b] = &vocab[b * max_w];
   }
-  fclose(f);
+  size = w_cols + a_cols;
   while (1) {
     for (a = 0; a < N; a++) bestd[a] = 0;
     for (a = 0; a < N; a++) bestw[a][0] = 0;
@@ -98,7 +195,7 @@ int main(int argc, char **argv) {
       continue;
     }
     for (a = 0; a < cn; a++) {
-      for (b = 0; b < words; b++) if (!strcmp(&vocab[b * max_w], st[a])) break;
+      for (b = 0; b < words; b++) if (!strcmp(word_names[b], st[a])) break;
       if (b == words) b = 0;
       bi[a] = b;
       printf("\nWord: %s  Position in vocabulary: %lld\n", st[a], bi[a]);
@@ -109,14 +206,38 @@ int main(int argc, char **argv) {
     }
     if (b == 0) continue;
     printf("\n                                              Word              Distance\n------------------------------------------------------------------------\n");
-    for (a = 0; a < size; a++) vec[a] = M[a + bi[1] * size] - M[a + bi[0] * size] + M[a + bi[2] * size];
+    for (a = 0; a < w_cols; a++) vec[a] = W[a + bi[1] * w_cols] * (scale ? scale[bi[1]] : 1) - W[a + bi[0] * w_cols] * (scale ? scale[bi[0]] : 1) +
+      W[a + bi[2] * w_cols] * (scale ? scale[bi[2]] : 1);
+    for (a = 0; a < a_cols; a++) vec[w_cols + a] = A[a + bi[1] * a_cols] * scale[bi[1]] - A[a + bi[0] * a_cols] * scale[bi[0]] +
+      A[a + bi[2] * a_cols] * scale[bi[2]];
     len = 0;
     for (a = 0; a < size; a++) len += vec[a] * vec[a];
     len = sqrt(len);
     for (a = 0; a < size; a++) vec[a] /= len;
     for (a = 0; a < N; a++) bestd[a] = 0;
     for (a = 0; a < N; a++) bestw[a][0] = 0;
-    for (c = 0; c < words; c++) {
+    candidates = words;
+    if (QW != NULL) {
+      // The int8 scan keeps the R best approximate scores; only those are scored in float below
+      qw_scale = QuantizeQuery(vec, w_cols, qvec);
+      qa_scale = QuantizeQuery(vec + w_cols, a_cols, qvec + w_cols);
+      candidates = 0;
+      for (c = 0; c < words; c++) {
+        a = 0;
+        for (b = 0; b < cn; b++) if (bi[b] == c) a = 1;
+        if (a == 1) continue;
+        dist = (Dot8(qvec, QW + c * w_cols, w_cols) * qw_scale * QS[c * 2] +
+          Dot8(qvec + w_cols, QA + c * a_cols, a_cols) * qa_scale * QS[c * 2 + 1]) * scale[c];
+        if (candidates == R && dist <= cand_d[worst]) continue;
+        if (candidates < R) worst = candidates++;
+        cand[worst] = c;
+        cand_d[worst] = dist;
+        if (candidates < R) continue;
+        for (e = 0; e < R; e++) if (cand_d[e] < cand_d[worst]) worst = e;
+      }
+    }
+    for (e = 0; e < candidates; e++) {
+      c = QW != NULL ? cand[e] : e;
       if (c == bi[0]) continue;
       if (c == bi[1]) continue;
       if (c == bi[2]) continue;
@@ -124,7 +245,9 @@ int main(int argc, char **argv) {
       for (b = 0; b < cn; b++) if (bi[b] == c) a = 1;
       if (a == 1) continue;
       dist = 0;
-      for (a = 0; a < size; a++) dist += vec[a] * M[a + c * size];
+      for (a = 0; a < w_cols; a++) dist += vec[a] * W[a + c * w_cols];
+      for (a = 0; a < a_cols; a++) dist += vec[w_cols + a] * A[a + c * a_cols];
+      if (scale) dist *= scale[c];
       for (a = 0; a < N; a++) {
         if (dist > bestd[a]) {
           for (d = N - 1; d > a; d--) {
@@ -132,7 +255,7 @@ int main(int argc, char **argv) {
             strcpy(bestw[d], bestw[d - 1]);
           }
           bestd[a] = dist;
-          strcpy(bestw[a], &vocab[c * max_w]);
+          strcpy(bestw[a], word_names[c]);
           break;
         }
       }
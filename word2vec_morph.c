@@ -12,26 +12,90 @@
 //  See the License for the specific language governing permissions and
 //  limitations under the License.
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <netdb.h>
+#include <linux/perf_event.h>
+#include <sched.h>
+#include <time.h>
 
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
 #define MAX_SENTENCE_LENGTH 1000
 #define MAX_CODE_LENGTH 40
+#define VOCAB_CACHE_VERSION 1
+#define COUNT_SHARD_VERSION 1
+#define CHECKPOINT_VERSION 3
+#define CHECKPOINT_BUFFER (1 << 20)     // Bytes staged per write() while saving a checkpoint
+#define MONITOR_USEC 10000              // Interval at which progress is summed up and alpha published
+#define PROGRESS_TICKS 10               // Monitor intervals between progress lines
+#define PHASE_VOCAB 0
+#define PHASE_INIT_NET 1
+#define PHASE_UNIGRAM 2
+#define PHASE_TRAINING 3
+#define PHASE_EXPORT 4
+#define NUM_PHASES 5
+#define SAMPLER_TABLE 0
+#define SAMPLER_ALIAS 1
+#define PERF_COUNTERS 4                 // cycles, instructions, LLC misses, dTLB misses
+#define PERF_READER 0
+#define PERF_SGD 1
+#define TRACE_EVENTS (1 << 16)          // Events kept per traced thread
+#define TRACE_SAMPLE 64                 // One in this many sentences of a thread is traced
+#define LOSS_SAMPLE 32                  // One in this many training positions adds to the sampled loss
+#define CACHE_ALIGN 64
 
-const int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
+#define SKETCH_DEPTH 4
+#define INIT_CHUNK (2 << 20)            // Bytes of a matrix initialized by one thread: one huge page
+#define MAX_PLACEMENT_SAMPLES 1024
+#define NUMA_NONE 0
+#define NUMA_INTERLEAVE 1
+#define NUMA_PARTITION 2
+#define ALPHA_LINEAR 0
+#define ALPHA_CONSTANT 1
+#define MATRIX_FILE_VERSION 1
+#define MATRIX_FILE_HEADER 4096         // Bytes before the rows of a matrix file, keeping them page aligned
+#define MODEL_FILE_VERSION 2
+#define MODEL_FILE_HEADER 4096
+#define SYNC_VERSION 1
+#define SYNC_CONNECT_SECONDS 60         // How long workers retry connecting to the coordinator
+#define EXPORT_BLOCK 4096               // Rows an export thread formats before handing them to the file
+#define KMEANS_ROW_BLOCK 32             // K-means compares blocks of rows against blocks of centroids that stay in L2
+#define KMEANS_CENT_BLOCK 128
+#define KMEANS_SAMPLE 8                 // k-means++ seeds from this many random words per class
+#define REDUCE_BLOCK 64                 // Rows per block of the covariance products in -reduce-*-size
+#define REDUCE_OVERSAMPLE 10            // Extra directions of the randomized range finder
+#define REDUCE_POWER_ITER 4
+#define KMEANS_PLUSPLUS 0
+#define KMEANS_RANDOM 1
+#define AUTOTUNE_WARMUP 0.25            // Share of an -autotune trial before its words are counted
+#define HOT_ROW_SHARE 0.9               // Share of training tokens whose rows are prefetched from matrix files
+#define BOUNDED_ENTRY_BYTES 192         // Estimated bytes per word + lemma entry in bounded counting
+
+int vocab_hash_size = 30000000;  // Maximum 30 * 0.7 = 21M words in the vocabulary
 
 typedef float real;                    // Precision of float numbers
 
+struct lemma_count;
+
+// Rarely touched per-word data; counts and subsampling thresholds live in dense arrays
 struct vocab_word {
-  long long cn;
   int *point;
   char *word, *code, codelen;
+  struct lemma_count *lemma_counts;     // Lemmas seen with this word while learning the vocabulary
 };
 
 struct lemma_struct {
@@ -45,27 +109,203 @@ struct lemma_count {
   struct lemma_count *next;
 };
 
+// Header of the binary vocabulary cache; every section offset is aligned to CACHE_ALIGN bytes
+struct vocab_cache_header {
+  char magic[8];
+  int version, hash_size;
+  long long vocab_size, lemmas_size, pairs_size, train_words, file_size, min_count;
+  long long vocab_cn_offset, vocab_str_offset, lemma_cn_offset, lemma_str_offset;
+  long long pair_start_offset, pair_lemma_offset, pair_cn_offset;
+  long long vocab_hash_offset, lemma_hash_offset, strings_offset, strings_size;
+};
+
+// Header of a count shard: raw word, lemma and word-lemma counts of one part of the corpus,
+// followed by the counts, the (word, lemma) position pairs and the strings
+struct count_shard_header {
+  char magic[8];
+  int version, reserved;
+  long long vocab_size, lemmas_size, pairs_size, train_words, file_size, strings_size;
+};
+
+// Where a training thread stands in the corpus; recorded at a sentence boundary whenever a
+// checkpoint is requested. words and the sampled loss are the thread's running totals, only
+// written by the thread itself, and the struct fills two cache lines so threads do not share one
+struct thread_state {
+  long long file_pos, word_count, last_word_count, local_iter, recorded_words;
+  unsigned long long next_random;
+  volatile long long words;
+  volatile int epoch, done;
+  volatile double loss;
+  volatile long long loss_samples;
+  volatile long long dropped;           // Words discarded by subsampling
+  volatile double read_time;            // Seconds spent reading sentences, measured with -stats-file
+  char pad[32];
+};
+
+// Header of a training checkpoint, followed by the thread states, syn0_w, syn0_l, syn1neg
+// and the word-lemma counts (per word: the number of lemmas, then lemma and count pairs)
+struct checkpoint_header {
+  char magic[8];
+  int version, num_threads;
+  long long vocab_size, lemmas_size, layer1_w_size, layer1_l_size, negative, iter, train_words, word_count_actual;
+  real alpha, starting_alpha;
+};
+
+// Staging buffer for writing a checkpoint with plain write() calls, which stay safe in a forked child
+struct checkpoint_writer {
+  int fd, failed;
+  long long used;
+  char *buf;
+};
+
+// Header of a matrix backed by a file in -mmap-dir; complete is set once the final
+// parameters have been written back after training
+struct matrix_file_header {
+  char magic[8];
+  long long version, rows, cols, complete;
+};
+
+// Header of the -output-model container. Offsets count bytes from the start of the file and
+// are 64-byte aligned; vectors are float32 rows in host byte order. The magic is written last
+struct model_file_header {
+  char magic[8];
+  long long version, words, lemmas, word_size, lemma_size, pairs;
+  long long word_vectors, lemma_vectors, average_vectors;   // words x word_size, lemmas x lemma_size, words x lemma_size
+  long long word_norms, average_norms;                      // One float per word
+  long long word_names, lemma_names, strings;               // words + 1 and lemmas + 1 offsets into strings
+  long long pair_start, pair_lemma, pair_weight;            // CSR word -> lemma weights: words + 1 long longs, pairs ints and floats
+  long long bytes;
+  // With -quantize, int8 copies of the word vectors and averages with two float scales per word; 0 otherwise
+  long long quant_word, quant_average, quant_scales;
+};
+
+struct matrix_file {
+  char *base;
+  long long bytes;
+};
+
+// A span of the -trace timeline, or an instant event when end is negative
+struct trace_event {
+  const char *name;
+  double begin, end;
+  long long arg;
+};
+
+// Events of one thread; only that thread appends to it
+struct trace_buffer {
+  struct trace_event *events;
+  long long size, lost;
+};
+
+// Sent by each worker when it connects to the coordinator; all workers must agree on the model shape
+struct sync_hello {
+  char magic[8];
+  long long version, worker_id, num_workers, vocab_size, lemmas_size, layer1_w_size, layer1_l_size, negative, sync_rows;
+};
+
+// Precedes the n parameter deltas a worker sends in each round; done is set once its training threads finished
+struct sync_header {
+  long long round, done, n;
+};
+
+// Count-min sketch estimating counts of every word seen, including the ones not kept in the vocabulary
+struct count_min_sketch {
+  long long *counts, width, total;
+};
+
+// Space-Saving style table for bounded counting: a min-heap of vocabulary (or lemma) positions
+// ordered by their counts, so the least frequent entry can be replaced by a more frequent newcomer
+struct heavy_hitters {
+  int *heap, *pos, *epoch;              // Position of each entry in the heap; epoch counts its evictions
+  long long *cn, *err, size, capacity, evictions;
+};
+
 char train_file[MAX_STRING], output_file[MAX_STRING], output_lemmas_file[MAX_STRING], output_num_lemmas_file[MAX_STRING];
 char save_vocab_file[MAX_STRING], read_vocab_file[MAX_STRING];
-char save_lemmas_file[MAX_STRING], read_lemmas_file[MAX_STRING];
+char save_lemmas_file[MAX_STRING], read_lemmas_file[MAX_STRING], vocab_cache_file[MAX_STRING];
+char count_shard_file[MAX_STRING], *merge_shards = NULL;
 struct vocab_word *vocab;
+long long *vocab_cn;
+unsigned short *vocab_keep;             // Subsampling keeps a word when the low 16 random bits are at most this
 struct lemma_struct *lemmas;
 struct lemma_count *word_lemma_counts;
 
 int binary = 0, cbow = 1, debug_mode = 2, window = 5, min_count = 5, num_threads = 12, min_reduce = 1;
 int *vocab_hash;
 int *lemma_hash;
+int hash_tables_mapped = 0;            // The hash tables point into the mapped vocabulary cache
+int count_lemmas_in_training = 1;      // Word-lemma counts are unknown until the training pass
 long long vocab_max_size = 1000, vocab_size = 0, layer1_w_size = 50;
 long long lemmas_max_size = 1000, lemmas_size = 0, layer1_l_size = 50; 
 long long layer1_size = 100;
 long long train_words = 0, word_count_actual = 0, iter = 5, file_size = 0, classes = 0;
 real alpha = 0.025, starting_alpha, sample = 1e-3;
 real *syn0_w, *syn0_l, *syn1, *syn1neg, *expTable;
-clock_t start;
+double program_start, training_start;
+double loss_sum = 0, early_stop = 0;    // Stop once an epoch improves the sampled loss by less than early_stop
+long long loss_samples = 0;
+volatile int stop_training = 0;
+
+char stats_file[MAX_STRING];
+double stats_every = 10;                // Seconds between writes of the stats file
+double phase_start[NUM_PHASES], phase_time[NUM_PHASES];
+const char *phase_names[NUM_PHASES] = {"vocab", "init_net", "unigram_table", "training", "export"};
 
-int hs = 0, negative = 5;
+int perf_counters = 0;
+const char *perf_names[PERF_COUNTERS] = {"cycles", "instructions", "LLC misses", "dTLB misses"};
+int perf_available[PERF_COUNTERS];
+unsigned long long *perf_epochs;        // Per epoch, part of the loop and counter, summed over the threads
+
+char trace_file[MAX_STRING];
+int tracing = 0, trace_main, trace_sync, trace_averaging;   // Buffers after those of the training threads
+int trace_threads = 0;                  // Buffers for training threads, enough for any -autotune choice
+struct trace_buffer *trace_buffers;
+
+int numa_policy = NUMA_NONE, pin_threads = 0, huge_pages = 0, numa_nodes = 1;
+int *thread_cpu = NULL;                 // CPU of each training thread; thread t runs on node t % numa_nodes
+char mmap_dir[MAX_STRING], output_model_file[MAX_STRING], output_npy_prefix[MAX_STRING];
+struct matrix_file *matrix_files = NULL;
+int num_matrix_files = 0;
+int num_replicas = 1, averaging_rounds = 0;
+volatile int training_done = 0;
+long long average_every = 1000000;
+real **replica_syn0_w, **replica_syn0_l, **replica_syn1neg;   // Thread t trains replica t % num_replicas
+double averaging_time = 0;
+int deterministic = 0;                  // Bit-identical results for a given -seed and -threads
+double autotune = 0;                    // Seconds per candidate setting of -autotune
+unsigned long long seed = 0;
+pthread_barrier_t round_barrier;        // Ends the rounds of -deterministic training
+long long round_words, rounds_per_epoch, rounds_done = 0;
+
+char checkpoint_file[MAX_STRING + 8];
+double checkpoint_every = 0;           // Minutes between checkpoints
+int resume = 0;
+volatile int checkpoint_epoch = 0, checkpoint_forked = 0, threads_finished = 0;
+struct thread_state *thread_states;
+char *checkpoint_buffer;
+
+char sync_connect[MAX_STRING];          // host:port of the coordinator of a multi-process run
+int sync_port = 0, num_workers = 1, worker_id = 0, sync_fd = -1;
+long long sync_every = 1000000, staleness = 1, sync_rows = 0;
+volatile long long sync_rounds = 0;     // Exchanges with the coordinator completed so far
+real *sync_syn0_w, *sync_syn0_l, *sync_syn1neg;   // Parameters as of the last exchange
+
+char continue_file[MAX_STRING];         // Checkpoint of the model that -continue extends
+long long old_vocab_size = 0, old_lemmas_size = 0;
+int alpha_schedule = ALPHA_LINEAR;
+
+int hs = 0, negative = 5, sampler = SAMPLER_TABLE, dry_run = 0, normalize = 0, quantize = 0;
+int kmeans_iter = 10, kmeans_init = KMEANS_PLUSPLUS;
+long long kmeans_batch = 0, reduce_w_size = 0, reduce_l_size = 0;
 const int table_size = 1e8;
 int *table;
+unsigned int *alias_threshold;          // Alias method: keep column i when 24 random bits are below this
+int *alias_index;
+long long max_memory = 0;
+
+long long vocab_memory = 0;
+struct count_min_sketch word_sketch, lemma_sketch;
+struct heavy_hitters word_hitters, lemma_hitters;
 
 struct lemma_count* CreateNode(long long lemma, struct lemma_count* next)
 {
@@ -122,24 +362,156 @@ int NumLemmas(struct lemma_count* head) {
     return num;
 }
 
+void FreeLemmaCounts(struct lemma_count* head) {
+  struct lemma_count* next;
+  while (head != NULL) {
+    next = head->next;
+    free(head);
+    head = next;
+  }
+}
+
+// Returns wall clock time in seconds
+double GetTime() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void InitTrace() {
+  long long a;
+  if (trace_threads < num_threads) trace_threads = num_threads;
+  trace_main = trace_threads;
+  trace_sync = trace_threads + 1;
+  trace_averaging = trace_threads + 2;
+  trace_buffers = (struct trace_buffer *)calloc(trace_threads + 3, sizeof(struct trace_buffer));
+  for (a = 0; a < trace_threads + 3; a++) trace_buffers[a].events = (struct trace_event *)malloc(TRACE_EVENTS * sizeof(struct trace_event));
+  tracing = 1;
+}
+
+void TraceEvent(int buffer, const char *name, double begin, double end, long long arg) {
+  struct trace_buffer *b;
+  if (!tracing) return;
+  b = &trace_buffers[buffer];
+  if (b->size == TRACE_EVENTS) {
+    b->lost++;
+    return;
+  }
+  b->events[b->size].name = name;
+  b->events[b->size].begin = begin;
+  b->events[b->size].end = end;
+  b->events[b->size].arg = arg;
+  b->size++;
+}
+
+// Records a span from begin until now
+void TraceSpan(int buffer, const char *name, double begin) {
+  if (tracing) TraceEvent(buffer, name, begin, GetTime(), -1);
+}
+
+void BeginPhase(int phase) {
+  phase_start[phase] = GetTime();
+}
+
+void EndPhase(int phase) {
+  phase_time[phase] = GetTime() - phase_start[phase];
+  TraceSpan(trace_main, phase_names[phase], phase_start[phase]);
+}
+
+// Writes the recorded events in the Chrome trace-event format read by chrome://tracing and Perfetto
+void WriteTrace() {
+  struct trace_event *e;
+  long long a, b, lost = 0;
+  int first = 1;
+  FILE *fo;
+  if (!tracing) return;
+  fo = fopen(trace_file, "wb");
+  if (fo == NULL) {
+    printf("WARNING: cannot write trace %s\n", trace_file);
+    return;
+  }
+  fprintf(fo, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+  for (a = 0; a < trace_threads + 3; a++) {
+    if (a >= num_threads && a < trace_threads) continue;
+    if (a < num_threads) fprintf(fo, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lld, \"args\": {\"name\": \"train %lld\"}}",
+      first ? "" : ",\n", a, a);
+    else fprintf(fo, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %lld, \"args\": {\"name\": \"%s\"}}",
+      first ? "" : ",\n", a, a == trace_main ? "main" : (a == trace_sync ? "sync" : "averaging"));
+    first = 0;
+    for (b = 0; b < trace_buffers[a].size; b++) {
+      e = &trace_buffers[a].events[b];
+      if (e->end < 0) fprintf(fo, ",\n{\"name\": \"%s\", \"ph\": \"i\", \"s\": \"t\", \"pid\": 1, \"tid\": %lld, \"ts\": %.1f",
+        e->name, a, (e->begin - program_start) * 1e6);
+      else fprintf(fo, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lld, \"ts\": %.1f, \"dur\": %.1f",
+        e->name, a, (e->begin - program_start) * 1e6, (e->end - e->begin) * 1e6);
+      if (e->arg >= 0) fprintf(fo, ", \"args\": {\"n\": %lld}}", e->arg);
+      else fprintf(fo, "}");
+    }
+    lost += trace_buffers[a].lost;
+  }
+  fprintf(fo, "\n]}\n");
+  fclose(fo);
+  if (debug_mode > 0) printf("Wrote trace %s%s\n", trace_file, lost ? " (some events were dropped after the buffers filled up)" : "");
+}
+
 void InitUnigramTable() {
   int a, i;
   double train_words_pow = 0;
   double d1, power = 0.75;
   table = (int *)malloc(table_size * sizeof(int));
-  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab[a].cn, power);
+  for (a = 0; a < vocab_size; a++) train_words_pow += pow(vocab_cn[a], power);
   i = 0;
-  d1 = pow(vocab[i].cn, power) / train_words_pow;
+  d1 = pow(vocab_cn[i], power) / train_words_pow;
   for (a = 0; a < table_size; a++) {
     table[a] = i;
     if (a / (double)table_size > d1) {
       i++;
-      d1 += pow(vocab[i].cn, power) / train_words_pow;
+      d1 += pow(vocab_cn[i], power) / train_words_pow;
     }
     if (i >= vocab_size) i = vocab_size - 1;
   }
 }
 
+// Builds the alias tables for drawing negative samples from the same distribution as the unigram
+// table, exactly and in 8 bytes per word instead of 4 bytes per table entry (Vose's method)
+void InitAliasSampler() {
+  long long a, small_size = 0, large_size = 0, s, l;
+  double sum = 0, *prob = (double *)malloc(vocab_size * sizeof(double));
+  long long *small = (long long *)malloc(vocab_size * sizeof(long long));
+  long long *large = (long long *)malloc(vocab_size * sizeof(long long));
+  alias_threshold = (unsigned int *)malloc(vocab_size * sizeof(unsigned int));
+  alias_index = (int *)malloc(vocab_size * sizeof(int));
+  for (a = 0; a < vocab_size; a++) sum += pow(vocab_cn[a], 0.75);
+  for (a = 0; a < vocab_size; a++) {
+    prob[a] = pow(vocab_cn[a], 0.75) / sum * vocab_size;
+    alias_index[a] = a;
+    if (prob[a] < 1) small[small_size++] = a; else large[large_size++] = a;
+  }
+  while (small_size > 0 && large_size > 0) {
+    s = small[--small_size];
+    l = large[--large_size];
+    alias_threshold[s] = prob[s] * (1 << 24);
+    alias_index[s] = l;
+    prob[l] -= 1 - prob[s];
+    if (prob[l] < 1) small[small_size++] = l; else large[large_size++] = l;
+  }
+  while (large_size > 0) alias_threshold[large[--large_size]] = 1 << 24;
+  while (small_size > 0) alias_threshold[small[--small_size]] = 1 << 24;
+  free(prob);
+  free(small);
+  free(large);
+}
+
+// Draws a negative sample from the upper bits of next_random
+static inline long long SampleNegative(unsigned long long next_random) {
+  long long column;
+  if (sampler == SAMPLER_TABLE) return table[(next_random >> 16) % table_size];
+  column = (next_random >> 16) % vocab_size;
+  // The coin comes from the following LCG step, so it is independent of the column
+  if ((((next_random * (unsigned long long)25214903917 + 11) >> 24) & 0xFFFFFF) < alias_threshold[column]) return column;
+  return alias_index[column];
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin, char *eof) {
   int a = 0, ch;
@@ -274,12 +646,14 @@ int AddWordToVocab(char *word) {
   if (length > MAX_STRING) length = MAX_STRING;
   vocab[vocab_size].word = (char *)calloc(length, sizeof(char));
   strcpy(vocab[vocab_size].word, word);
-  vocab[vocab_size].cn = 0;
+  vocab_cn[vocab_size] = 0;
+  vocab[vocab_size].lemma_counts = NULL;
   vocab_size++;
   // Reallocate memory if needed
   if (vocab_size + 2 >= vocab_max_size) {
     vocab_max_size += 1000;
     vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+    vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
   }
   hash = GetWordHash(word);
   while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
@@ -305,53 +679,103 @@ int AddLemmaToLemmas(char *lemma) {
   return lemmas_size - 1;
 }
 
-// Used later for sorting by word counts
+// Counts occurrences of a lemma with a word while learning the vocabulary
+void AddWordLemmaCount(long long word, long long lemma, long long cn) {
+  struct lemma_count* cursor = vocab[word].lemma_counts;
+  while (cursor != NULL) {
+    if (cursor->lemma == lemma) {
+      cursor->cn += cn;
+      return;
+    }
+    cursor = cursor->next;
+  }
+  vocab[word].lemma_counts = CreateNode(lemma, vocab[word].lemma_counts);
+  vocab[word].lemma_counts->cn = cn;
+}
+
+// Moves the learned word-lemma counts into word_lemma_counts, indexed by the sorted vocabulary
+void BuildWordLemmaCounts() {
+  long long a;
+  word_lemma_counts = (struct lemma_count *)calloc(vocab_size, sizeof(struct lemma_count));
+  for (a = 0; a < vocab_size; a++) {
+    if (vocab[a].lemma_counts == NULL) {
+      word_lemma_counts[a].lemma = -1;
+      continue;
+    }
+    word_lemma_counts[a] = *vocab[a].lemma_counts;
+    free(vocab[a].lemma_counts);
+    vocab[a].lemma_counts = NULL;
+  }
+  count_lemmas_in_training = 0;
+}
+
+// Used later for sorting vocabulary positions by word counts
 int VocabCompare(const void *a, const void *b) {
-  long long l = ((struct vocab_word *)b)->cn - ((struct vocab_word *)a)->cn;
+  long long l = vocab_cn[*(int *)b] - vocab_cn[*(int *)a];
   if (l > 0) return 1;
   if (l < 0) return -1;
   return 0;
 }
 
-// Sorts the vocabulary by frequency using word counts
-void SortVocab() {
+// Sorts the vocabulary by frequency using word counts; entries before position first keep their
+// place and are never discarded
+void SortVocabFrom(int first) {
   int a, size;
   unsigned int hash;
-  // Sort the vocabulary and keep </s> at the first position
-  qsort(&vocab[1], vocab_size - 1, sizeof(struct vocab_word), VocabCompare);
+  int *order = (int *)malloc(vocab_size * sizeof(int));
+  struct vocab_word *sorted = (struct vocab_word *)malloc((vocab_size + 1) * sizeof(struct vocab_word));
+  long long *sorted_cn = (long long *)malloc((vocab_size + 1) * sizeof(long long));
+  for (a = 0; a < vocab_size; a++) order[a] = a;
+  qsort(&order[first], vocab_size - first, sizeof(int), VocabCompare);
+  for (a = 0; a < vocab_size; a++) {
+    sorted[a] = vocab[order[a]];
+    sorted_cn[a] = vocab_cn[order[a]];
+  }
+  free(order);
+  free(vocab);
+  free(vocab_cn);
+  vocab = sorted;
+  vocab_cn = sorted_cn;
   for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
   size = vocab_size;
   train_words = 0;
   for (a = 0; a < size; a++) {
     // Words occuring less than min_count times will be discarded from the vocab
-    if ((vocab[a].cn < min_count) && (a != 0)) {
+    if ((vocab_cn[a] < min_count) && (a >= first)) {
       vocab_size--;
       free(vocab[a].word);
+      FreeLemmaCounts(vocab[a].lemma_counts);
     } else {
       // Hash will be re-computed, as after the sorting it is not actual
       hash=GetWordHash(vocab[a].word);
       while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
       vocab_hash[hash] = a;
-      train_words += vocab[a].cn;
+      train_words += vocab_cn[a];
     }
   }
-  vocab = (struct vocab_word *)realloc(vocab, (vocab_size + 1) * sizeof(struct vocab_word));
-  // Allocate memory for the binary tree construction
-  for (a = 0; a < vocab_size; a++) {
-    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
-    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
-  }
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+}
+
+// Sorts the whole vocabulary and keeps </s> at the first position
+void SortVocab() {
+  SortVocabFrom(1);
 }
 
 // Reduces the vocabulary by removing infrequent tokens
 void ReduceVocab() {
   int a, b = 0;
   unsigned int hash;
-  for (a = 0; a < vocab_size; a++) if (vocab[a].cn > min_reduce) {
-    vocab[b].cn = vocab[a].cn;
+  for (a = 0; a < vocab_size; a++) if (vocab_cn[a] > min_reduce) {
+    vocab_cn[b] = vocab_cn[a];
     vocab[b].word = vocab[a].word;
+    vocab[b].lemma_counts = vocab[a].lemma_counts;
     b++;
-  } else free(vocab[a].word);
+  } else {
+    free(vocab[a].word);
+    FreeLemmaCounts(vocab[a].lemma_counts);
+  }
   vocab_size = b;
   for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
   for (a = 0; a < vocab_size; a++) {
@@ -367,12 +791,33 @@ void ReduceVocab() {
 void ReduceLemmas() {
   int a, b = 0;
   unsigned int hash;
+  struct lemma_count **link, *cursor;
+  long long *new_index = (long long *)malloc(lemmas_size * sizeof(long long));
   for (a = 0; a < lemmas_size; a++) if (lemmas[a].cn > min_reduce) {
     lemmas[b].cn = lemmas[a].cn;
     lemmas[b].lemma = lemmas[a].lemma;
+    new_index[a] = b;
     b++;
-  } else free(lemmas[a].lemma);
+  } else {
+    free(lemmas[a].lemma);
+    new_index[a] = -1;
+  }
   lemmas_size = b;
+  // Word-lemma counts refer to lemma positions, which have just moved
+  for (a = 0; a < vocab_size; a++) {
+    link = &vocab[a].lemma_counts;
+    while (*link != NULL) {
+      cursor = *link;
+      if (new_index[cursor->lemma] == -1) {
+        *link = cursor->next;
+        free(cursor);
+      } else {
+        cursor->lemma = new_index[cursor->lemma];
+        link = &cursor->next;
+      }
+    }
+  }
+  free(new_index);
   for (a = 0; a < vocab_hash_size; a++) lemma_hash[a] = -1;
   for (a = 0; a < lemmas_size; a++) {
     // Hash will be re-computed, as it is not actual
@@ -392,7 +837,12 @@ void CreateBinaryTree() {
   long long *count = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
   long long *binary = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
   long long *parent_node = (long long *)calloc(vocab_size * 2 + 1, sizeof(long long));
-  for (a = 0; a < vocab_size; a++) count[a] = vocab[a].cn;
+  // Codes are only needed for hierarchical softmax, so they are allocated here
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].code = (char *)calloc(MAX_CODE_LENGTH, sizeof(char));
+    vocab[a].point = (int *)calloc(MAX_CODE_LENGTH, sizeof(int));
+  }
+  for (a = 0; a < vocab_size; a++) count[a] = vocab_cn[a];
   for (a = vocab_size; a < vocab_size * 2; a++) count[a] = 1e15;
   pos1 = vocab_size - 1;
   pos2 = vocab_size;
@@ -451,11 +901,252 @@ void CreateBinaryTree() {
   free(parent_node);
 }
 
-void LearnVocabLemmasFromTrainFile() {
+// Parses a byte count with an optional K, M, G or T suffix
+long long ParseMemorySize(char *str) {
+  char *end;
+  const char *suffixes = "KkMmGgTt", *suffix;
+  double size = strtod(str, &end);
+  // K, M, G and T in either case multiply by successive powers of 1024
+  suffix = *end != 0 ? strchr(suffixes, *end) : NULL;
+  if (suffix != NULL) size *= pow(1024, (suffix - suffixes) / 2 + 1);
+  return (long long)size;
+}
+
+// Scrambles the bits of a 64 bit value (MurmurHash3 finalizer)
+unsigned long long MixBits(unsigned long long x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+// Start of random stream <stream>. Without -seed these are the small integers word2vec always used;
+// with it they are hashes of the seed, so that different seeds give unrelated runs
+unsigned long long RandomStream(unsigned long long stream) {
+  return seed ? MixBits(MixBits(seed) + stream) : stream;
+}
+
+// Returns a well mixed 64 bit hash of a string for the count-min sketch
+unsigned long long GetSketchHash(char *str, unsigned long long seed) {
+  unsigned long long hash = seed;
+  while (*str) hash = hash * 257 + (unsigned char)*str++;
+  return MixBits(hash);
+}
+
+void InitSketch(struct count_min_sketch *sketch, long long bytes) {
+  sketch->width = bytes / SKETCH_DEPTH / sizeof(long long);
+  if (sketch->width < 1024) sketch->width = 1024;
+  sketch->counts = (long long *)calloc(sketch->width * SKETCH_DEPTH, sizeof(long long));
+  if (sketch->counts == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  sketch->total = 0;
+}
+
+// Adds one occurrence using conservative update and returns the new estimate, which is never
+// below the true count and exceeds it by more than e * total / width with probability below e^-depth
+long long SketchAdd(struct count_min_sketch *sketch, char *str) {
+  unsigned long long h1 = GetSketchHash(str, 0), h2 = GetSketchHash(str, 0x9e3779b97f4a7c15ULL) | 1;
+  long long d, cell[SKETCH_DEPTH], est = -1;
+  for (d = 0; d < SKETCH_DEPTH; d++) {
+    cell[d] = d * sketch->width + (h1 + d * h2) % sketch->width;
+    if (est == -1 || sketch->counts[cell[d]] < est) est = sketch->counts[cell[d]];
+  }
+  est++;
+  for (d = 0; d < SKETCH_DEPTH; d++) if (sketch->counts[cell[d]] < est) sketch->counts[cell[d]] = est;
+  sketch->total++;
+  return est;
+}
+
+void InitHitters(struct heavy_hitters *hitters, long long capacity) {
+  hitters->capacity = capacity;
+  hitters->size = 0;
+  hitters->evictions = 0;
+  hitters->heap = (int *)malloc(capacity * sizeof(int));
+  hitters->pos = (int *)malloc(capacity * sizeof(int));
+  hitters->epoch = (int *)calloc(capacity, sizeof(int));
+  hitters->cn = (long long *)calloc(capacity, sizeof(long long));
+  hitters->err = (long long *)calloc(capacity, sizeof(long long));
+  if (hitters->heap == NULL || hitters->pos == NULL || hitters->epoch == NULL || hitters->cn == NULL || hitters->err == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+void FreeHitters(struct heavy_hitters *hitters) {
+  free(hitters->heap);
+  free(hitters->pos);
+  free(hitters->epoch);
+  free(hitters->cn);
+  free(hitters->err);
+}
+
+// Restores the heap order after the count of the entry at heap position i has grown
+void HittersSiftDown(struct heavy_hitters *hitters, long long i) {
+  long long child;
+  int entry = hitters->heap[i];
+  while (1) {
+    child = 2 * i + 1;
+    if (child >= hitters->size) break;
+    if (child + 1 < hitters->size && hitters->cn[hitters->heap[child + 1]] < hitters->cn[hitters->heap[child]]) child++;
+    if (hitters->cn[hitters->heap[child]] >= hitters->cn[entry]) break;
+    hitters->heap[i] = hitters->heap[child];
+    hitters->pos[hitters->heap[i]] = i;
+    i = child;
+  }
+  hitters->heap[i] = entry;
+  hitters->pos[entry] = i;
+}
+
+void HittersPush(struct heavy_hitters *hitters, int entry) {
+  long long parent, i = hitters->size++;
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (hitters->cn[hitters->heap[parent]] <= hitters->cn[entry]) break;
+    hitters->heap[i] = hitters->heap[parent];
+    hitters->pos[hitters->heap[i]] = i;
+    i = parent;
+  }
+  hitters->heap[i] = entry;
+  hitters->pos[entry] = i;
+}
+
+// Removes an entry from an open addressing hash table, shifting later entries of its probe run back
+void RemoveFromHash(int *hash_table, int index, char *key) {
+  unsigned int i, j, home;
+  i = GetWordHash(key);
+  while (hash_table[i] != index) i = (i + 1) % vocab_hash_size;
+  j = i;
+  while (1) {
+    j = (j + 1) % vocab_hash_size;
+    if (hash_table[j] == -1) break;
+    home = GetWordHash(hash_table == vocab_hash ? vocab[hash_table[j]].word : lemmas[hash_table[j]].lemma);
+    // Entries whose home slot lies cyclically in (i, j] are still reachable and stay in place
+    if ((i < j) ? (home > i && home <= j) : (home > i || home <= j)) continue;
+    hash_table[i] = hash_table[j];
+    i = j;
+  }
+  hash_table[i] = -1;
+}
+
+// Counts a word in bounded memory; returns its vocabulary position, or -1 if it is not frequent enough to be kept
+long long CountWordBounded(char *word) {
+  unsigned int hash, length;
+  long long a, est = SketchAdd(&word_sketch, word);
+  a = SearchVocab(word);
+  if (a != -1) {
+    word_hitters.cn[a]++;
+    if (a != 0) HittersSiftDown(&word_hitters, word_hitters.pos[a]);
+    return a;
+  }
+  if (vocab_size < word_hitters.capacity) {
+    a = AddWordToVocab(word);
+    word_hitters.cn[a] = est;
+    word_hitters.err[a] = est - 1;
+    HittersPush(&word_hitters, a);
+    return a;
+  }
+  // The table is full: replace its least frequent word if the newcomer is estimated to be more frequent
+  a = word_hitters.heap[0];
+  if (est <= word_hitters.cn[a]) return -1;
+  RemoveFromHash(vocab_hash, a, vocab[a].word);
+  free(vocab[a].word);
+  FreeLemmaCounts(vocab[a].lemma_counts);
+  length = strlen(word) + 1;
+  if (length > MAX_STRING) length = MAX_STRING;
+  vocab[a].word = (char *)calloc(length, sizeof(char));
+  strcpy(vocab[a].word, word);
+  vocab[a].lemma_counts = NULL;
+  hash = GetWordHash(word);
+  while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+  vocab_hash[hash] = a;
+  word_hitters.cn[a] = est;
+  word_hitters.err[a] = est - 1;
+  word_hitters.evictions++;
+  HittersSiftDown(&word_hitters, 0);
+  return a;
+}
+
+// Counts a lemma in bounded memory; returns its position, or -1 if it is not frequent enough to be kept
+long long CountLemmaBounded(char *lemma) {
+  unsigned int hash, length;
+  long long a, est = SketchAdd(&lemma_sketch, lemma);
+  a = SearchLemmas(lemma);
+  if (a != -1) {
+    lemma_hitters.cn[a]++;
+    if (a != 0) HittersSiftDown(&lemma_hitters, lemma_hitters.pos[a]);
+    return a;
+  }
+  if (lemmas_size < lemma_hitters.capacity) {
+    a = AddLemmaToLemmas(lemma);
+    lemma_hitters.cn[a] = est;
+    lemma_hitters.err[a] = est - 1;
+    HittersPush(&lemma_hitters, a);
+    return a;
+  }
+  a = lemma_hitters.heap[0];
+  if (est <= lemma_hitters.cn[a]) return -1;
+  RemoveFromHash(lemma_hash, a, lemmas[a].lemma);
+  free(lemmas[a].lemma);
+  length = strlen(lemma) + 1;
+  if (length > MAX_STRING) length = MAX_STRING;
+  lemmas[a].lemma = (char *)calloc(length, sizeof(char));
+  strcpy(lemmas[a].lemma, lemma);
+  hash = GetLemmaHash(lemma);
+  while (lemma_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+  lemma_hash[hash] = a;
+  lemma_hitters.cn[a] = est;
+  lemma_hitters.err[a] = est - 1;
+  // Word-lemma counts still pointing at the evicted lemma are told apart by the epoch
+  lemma_hitters.epoch[a]++;
+  lemma_hitters.evictions++;
+  HittersSiftDown(&lemma_hitters, 0);
+  return a;
+}
+
+// Copies the bounded counts into the vocabulary, drops word-lemma counts of evicted lemmas
+// and reports the error bounds
+void FinishBoundedCounting() {
+  long long a, lemma, epoch, survivors = 0, uncertain = 0, max_err = 0;
+  struct lemma_count **link, *cursor;
+  for (a = 0; a < vocab_size; a++) {
+    vocab_cn[a] = word_hitters.cn[a];
+    if (a != 0 && vocab_cn[a] >= min_count) {
+      survivors++;
+      if (vocab_cn[a] - word_hitters.err[a] < min_count) uncertain++;
+      if (word_hitters.err[a] > max_err) max_err = word_hitters.err[a];
+    }
+    link = &vocab[a].lemma_counts;
+    while (*link != NULL) {
+      cursor = *link;
+      lemma = cursor->lemma & 0xFFFFFFFFLL;
+      epoch = cursor->lemma >> 32;
+      if (epoch != lemma_hitters.epoch[lemma]) {
+        *link = cursor->next;
+        free(cursor);
+      } else {
+        cursor->lemma = lemma;
+        link = &cursor->next;
+      }
+    }
+  }
+  for (a = 0; a < lemmas_size; a++) lemmas[a].cn = lemma_hitters.cn[a];
+  if (debug_mode > 0) {
+    printf("Bounded counting: %lld word and %lld lemma evictions\n", word_hitters.evictions, lemma_hitters.evictions);
+    printf("Count-min overestimate below %.0f with probability %.4f\n", exp(1) * word_sketch.total / word_sketch.width, 1 - exp(-SKETCH_DEPTH));
+    printf("%lld words reach min-count, %lld of them only within the error bound; largest overestimate %lld\n", survivors, uncertain, max_err);
+  }
+  free(word_sketch.counts);
+  free(lemma_sketch.counts);
+  FreeHitters(&word_hitters);
+  FreeHitters(&lemma_hitters);
+}
 
+// Counts words, lemmas and word-lemma pairs of the training file, without sorting or applying min-count
+void CountTrainFile() {
   char word[MAX_STRING], lemma[MAX_STRING], eof = 0;
   FILE *fin;
-  long long a, i, b, j, wc = 0;
+  long long a, i, j, wc = 0;
   for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
   for (a = 0; a < vocab_hash_size; a++) lemma_hash[a] = -1;
   fin = fopen(train_file, "rb");
@@ -465,6 +1156,13 @@ void LearnVocabLemmasFromTrainFile() {
   }
   vocab_size = 0;
   lemmas_size = 0;
+  if (vocab_memory > 0) {
+    // A quarter of the budget goes to the sketches, the rest to the vocabulary and lemma tables
+    InitSketch(&word_sketch, vocab_memory / 8);
+    InitSketch(&lemma_sketch, vocab_memory / 8);
+    InitHitters(&word_hitters, vocab_hash_size * 0.7);
+    InitHitters(&lemma_hitters, vocab_hash_size * 0.7);
+  }
   AddWordToVocab((char *)"</s>");
   AddLemmaToLemmas((char *)"</s>");
   while (1) {
@@ -480,28 +1178,48 @@ void LearnVocabLemmasFromTrainFile() {
       fflush(stdout);
       wc = 0;
     }
+    if (vocab_memory > 0) {
+      i = CountWordBounded(word);
+      j = CountLemmaBounded(lemma);
+      // The epoch in the upper bits marks counts of lemmas that are later evicted
+      if (i != -1 && j != -1) AddWordLemmaCount(i, j | ((long long)lemma_hitters.epoch[j] << 32), 1);
+      continue;
+    }
     i = SearchVocab(word);
     j = SearchLemmas(lemma);
     if (i == -1) {
-      a = AddWordToVocab(word);
-      vocab[a].cn = 1;
-    } else vocab[i].cn++;
+      i = AddWordToVocab(word);
+      vocab_cn[i] = 1;
+    } else vocab_cn[i]++;
     if (j == -1) {
-      b = AddLemmaToLemmas(lemma);
-      lemmas[b].cn = 1;
+      j = AddLemmaToLemmas(lemma);
+      lemmas[j].cn = 1;
     } else lemmas[j].cn++;
+    AddWordLemmaCount(i, j, 1);
     if (vocab_size > vocab_hash_size * 0.7) ReduceVocab();
     if (lemmas_size > vocab_hash_size * 0.7) ReduceLemmas();
   }
+  if (vocab_memory > 0) FinishBoundedCounting();
+  file_size = ftell(fin);
+  fclose(fin);
+}
+
+void LearnVocabLemmasFromTrainFile() {
+  double begin = GetTime();
+  CountTrainFile();
+  TraceSpan(trace_main, "CountTrainFile", begin);
+  begin = GetTime();
   SortVocab();
+  TraceSpan(trace_main, "SortVocab", begin);
+  begin = GetTime();
+  BuildWordLemmaCounts();
+  TraceSpan(trace_main, "BuildWordLemmaCounts", begin);
   // Should I do this for lemmas? Not sure what the purpose is
   if (debug_mode > 0) {
     printf("Vocab size: %lld\n", vocab_size);
     printf("Number of lemmas: %lld\n", lemmas_size);
     printf("Words in train file: %lld\n", train_words);
   }
-  file_size = ftell(fin);
-  fclose(fin);
 }
 
 // Should probably do this for lemmas, but not necessary right now
@@ -510,7 +1228,7 @@ void SaveVocabAndLemmas() {
   long long i;
   FILE *fo_v, *fo_l;
   fo_v = fopen(save_vocab_file, "wb");
-  for (i = 0; i < vocab_size; i++) fprintf(fo_v, "%s %lld\n", vocab[i].word, vocab[i].cn);
+  for (i = 0; i < vocab_size; i++) fprintf(fo_v, "%s %lld\n", vocab[i].word, vocab_cn[i]);
   fclose(fo_v);
 
   fo_l = fopen(save_lemmas_file, "wb");
@@ -534,7 +1252,7 @@ void ReadVocabAndLemmas() {
     ReadWord(word, fin, &eof);
     if (eof) break;
     a = AddWordToVocab(word);
-    fscanf(fin, "%lld%c", &vocab[a].cn, &c);
+    fscanf(fin, "%lld%c", &vocab_cn[a], &c);
     i++;
   }
   SortVocab();
@@ -543,13 +1261,15 @@ void ReadVocabAndLemmas() {
     printf("Words in train file: %lld\n", train_words);
   }
 
+  fclose(fin);
   fin = fopen(read_lemmas_file, "rb");
   if (fin == NULL) {
     printf("Lemma file not found\n");
     exit(1);
   }
   for (a = 0; a < vocab_hash_size; a++) lemma_hash[a] = -1;
-  vocab_size = 0;
+  lemmas_size = 0;
+  eof = 0;
   while (1) {
     ReadWord(lemma, fin, &eof);
     if (eof) break;
@@ -567,381 +1287,3147 @@ void ReadVocabAndLemmas() {
   fseek(fin, 0, SEEK_END);
   file_size = ftell(fin);
   fclose(fin);
+  // Text vocabularies carry no word-lemma counts, so they are collected during training
+  word_lemma_counts = (struct lemma_count *)calloc(vocab_size, sizeof(struct lemma_count));
+  for (a = 0; a < vocab_size; a++) word_lemma_counts[a].lemma = -1;
+  count_lemmas_in_training = 1;
 }
 
-void InitNet() {
-  long long a, b;
-  unsigned long long next_random = 1;
-  a = posix_memalign((void **)&syn0_w, 128, (long long)vocab_size * layer1_w_size * sizeof(real));
-  if (syn0_w == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  b = posix_memalign((void **)&syn0_l, 128, (long long)lemmas_size * layer1_l_size * sizeof(real));
-  if (syn0_l == NULL) {printf("Memory allocation failed\n"); exit(1);}
-  if (hs) {
-    a = posix_memalign((void **)&syn1, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1 == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     syn1[a * layer1_size + b] = 0;
-  }
-  if (negative>0) {
-    a = posix_memalign((void **)&syn1neg, 128, (long long)vocab_size * layer1_size * sizeof(real));
-    if (syn1neg == NULL) {printf("Memory allocation failed\n"); exit(1);}
-    for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_size; b++)
-     syn1neg[a * layer1_size + b] = 0;
-  }
-  for (a = 0; a < vocab_size; a++) for (b = 0; b < layer1_w_size; b++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    syn0_w[a * layer1_w_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_w_size;
-  }
-  for (a = 0; a < lemmas_size; a++) for (b = 0; b < layer1_l_size; b++) {
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    syn0_l[a * layer1_l_size + b] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / layer1_l_size;
-  }
-  CreateBinaryTree();
+// Rounds a vocabulary cache offset up to CACHE_ALIGN bytes
+long long CacheAlign(long long offset) {
+  return (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
 }
 
-void *TrainModelThread(void *id) {
-  long long a, b, d, cw, word, lemma, last_word, last_lemma, sentence_length = 0, sentence_position = 0;
-  long long word_count = 0, last_word_count = 0, sen_w[MAX_SENTENCE_LENGTH + 1], sen_l[MAX_SENTENCE_LENGTH + 1];
-  long long l1_w, l1_l, l2, c, target, label, local_iter = iter;
-  unsigned long long next_random = (long long)id;
-  char eof = 0;
-  real f, g;
-  clock_t now;
-  real *neu1 = (real *)calloc(layer1_size, sizeof(real));
-  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
-  FILE *fi = fopen(train_file, "rb");
-  fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-  while (1) {
-    if (word_count - last_word_count > 10000) {
-      word_count_actual += word_count - last_word_count;
-      last_word_count = word_count;
-      if ((debug_mode > 1)) {
-        now=clock();
-        printf("%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ", 13, alpha,
-         word_count_actual / (real)(iter * train_words + 1) * 100,
-         word_count_actual / ((real)(now - start + 1) / (real)CLOCKS_PER_SEC * 1000));
-        fflush(stdout);
-      }
-      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
-      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
-    }
-    if (sentence_length == 0) {
-      while (1) {
-        long long indices[2];
-        indices[0] = -1;
-        indices[1] = -1;
-        ReadWordLemmaIndices(fi, &eof, indices);
-        word = indices[0];
-        lemma = indices[1];
-        if (eof) break;
-        if (word == -1) continue;
-
-        word_count++;
-
-        if (lemma == -1) continue;
+// Pads the vocabulary cache with zeros up to the given offset
+void CachePad(FILE *fo, long long offset) {
+  while (ftell(fo) < offset) fputc(0, fo);
+}
 
-        //Add to word_lemma_counts here
-        if (word_lemma_counts[word].lemma == -1) {
-          word_lemma_counts[word].lemma = lemma;
-          word_lemma_counts[word].cn = 1;
-        } else {
-          FindAndIncrementNode(&(word_lemma_counts[word]), lemma);
-        }
+// Rebuilds the word and lemma hash tables at the given size; the old tables are freed unless they
+// live in the mapped cache
+void RehashTables(long long size) {
+  long long a;
+  unsigned int hash;
+  if (!hash_tables_mapped) {
+    free(vocab_hash);
+    free(lemma_hash);
+  }
+  hash_tables_mapped = 0;
+  vocab_hash_size = size;
+  vocab_hash = (int *)malloc((long long)vocab_hash_size * sizeof(int));
+  lemma_hash = (int *)malloc((long long)vocab_hash_size * sizeof(int));
+  if (vocab_hash == NULL || lemma_hash == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  for (a = 0; a < vocab_hash_size; a++) lemma_hash[a] = -1;
+  for (a = 0; a < vocab_size; a++) {
+    hash = GetWordHash(vocab[a].word);
+    while (vocab_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+    vocab_hash[hash] = a;
+  }
+  for (a = 0; a < lemmas_size; a++) {
+    hash = GetLemmaHash(lemmas[a].lemma);
+    while (lemma_hash[hash] != -1) hash = (hash + 1) % vocab_hash_size;
+    lemma_hash[hash] = a;
+  }
+}
 
-        if (word == 0) break;
-        // The subsampling randomly discards frequent words while keeping the ranking same
-        if (sample > 0) {
-          real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1) * (sample * train_words) / vocab[word].cn;
-          next_random = next_random * (unsigned long long)25214903917 + 11;
-          if (ran < (next_random & 0xFFFF) / (real)65536) continue;
-        }
+// Doubles the word and lemma hash tables once either is 70% full, as entries cannot be pruned
+// without changing the indices of trained rows
+void GrowHashTables() {
+  RehashTables((long long)vocab_hash_size * 2);
+}
 
-        sen_w[sentence_length] = word;
-        sen_l[sentence_length] = lemma;
-        sentence_length++;
-        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
-      }
-      sentence_position = 0;
+// Saves the sorted vocabulary, lemmas, word-lemma counts and both hash tables in a binary file
+// that ReadVocabCache() maps back into memory without parsing
+void SaveVocabCache() {
+  struct vocab_cache_header h;
+  struct lemma_count *cursor;
+  long long a, pairs = 0, str = 0, hash_size;
+  int lemma;
+  char tmp_file[MAX_STRING + 4];
+  FILE *fo;
+  if (count_lemmas_in_training) {
+    printf("Not saving vocabulary cache: word-lemma counts are only known when the vocabulary is learned from the training data\n");
+    return;
+  }
+  // Shrink the hash tables to the final vocabulary, so the file scales with it rather than with
+  // the 30M slots counting started from
+  hash_size = (vocab_size > lemmas_size ? vocab_size : lemmas_size) / 0.7 + 1;
+  if (hash_size < vocab_hash_size) RehashTables(hash_size);
+  for (a = 0; a < vocab_size; a++) if (word_lemma_counts[a].lemma != -1)
+    for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) pairs++;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "W2VMVOC", 8);
+  h.version = VOCAB_CACHE_VERSION;
+  h.hash_size = vocab_hash_size;
+  h.vocab_size = vocab_size;
+  h.lemmas_size = lemmas_size;
+  h.pairs_size = pairs;
+  h.train_words = train_words;
+  h.file_size = file_size;
+  h.min_count = min_count;
+  h.vocab_cn_offset = CacheAlign(sizeof(h));
+  h.vocab_str_offset = CacheAlign(h.vocab_cn_offset + vocab_size * sizeof(long long));
+  h.lemma_cn_offset = CacheAlign(h.vocab_str_offset + vocab_size * sizeof(long long));
+  h.lemma_str_offset = CacheAlign(h.lemma_cn_offset + lemmas_size * sizeof(long long));
+  h.pair_start_offset = CacheAlign(h.lemma_str_offset + lemmas_size * sizeof(long long));
+  h.pair_lemma_offset = CacheAlign(h.pair_start_offset + (vocab_size + 1) * sizeof(long long));
+  h.pair_cn_offset = CacheAlign(h.pair_lemma_offset + pairs * sizeof(int));
+  h.vocab_hash_offset = CacheAlign(h.pair_cn_offset + pairs * sizeof(long long));
+  h.lemma_hash_offset = CacheAlign(h.vocab_hash_offset + (long long)vocab_hash_size * sizeof(int));
+  h.strings_offset = CacheAlign(h.lemma_hash_offset + (long long)vocab_hash_size * sizeof(int));
+  for (a = 0; a < vocab_size; a++) h.strings_size += strlen(vocab[a].word) + 1;
+  for (a = 0; a < lemmas_size; a++) h.strings_size += strlen(lemmas[a].lemma) + 1;
+  // Write to a temporary file first, so an interrupted run never leaves a truncated cache behind
+  sprintf(tmp_file, "%s.tmp", vocab_cache_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write vocabulary cache %s\n", tmp_file);
+    exit(1);
+  }
+  fwrite(&h, sizeof(h), 1, fo);
+  CachePad(fo, h.vocab_cn_offset);
+  fwrite(vocab_cn, sizeof(long long), vocab_size, fo);
+  CachePad(fo, h.vocab_str_offset);
+  for (a = 0; a < vocab_size; a++) {
+    fwrite(&str, sizeof(long long), 1, fo);
+    str += strlen(vocab[a].word) + 1;
+  }
+  CachePad(fo, h.lemma_cn_offset);
+  for (a = 0; a < lemmas_size; a++) fwrite(&lemmas[a].cn, sizeof(long long), 1, fo);
+  CachePad(fo, h.lemma_str_offset);
+  for (a = 0; a < lemmas_size; a++) {
+    fwrite(&str, sizeof(long long), 1, fo);
+    str += strlen(lemmas[a].lemma) + 1;
+  }
+  CachePad(fo, h.pair_start_offset);
+  pairs = 0;
+  for (a = 0; a < vocab_size; a++) {
+    fwrite(&pairs, sizeof(long long), 1, fo);
+    if (word_lemma_counts[a].lemma != -1)
+      for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) pairs++;
+  }
+  fwrite(&pairs, sizeof(long long), 1, fo);
+  CachePad(fo, h.pair_lemma_offset);
+  for (a = 0; a < vocab_size; a++) if (word_lemma_counts[a].lemma != -1)
+    for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) {
+      lemma = cursor->lemma;
+      fwrite(&lemma, sizeof(int), 1, fo);
     }
-    if (eof || (word_count > train_words / num_threads)) {
-      word_count_actual += word_count - last_word_count;
-      local_iter--;
-      if (local_iter == 0) break;
-      word_count = 0;
+  CachePad(fo, h.pair_cn_offset);
+  for (a = 0; a < vocab_size; a++) if (word_lemma_counts[a].lemma != -1)
+    for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) fwrite(&cursor->cn, sizeof(long long), 1, fo);
+  CachePad(fo, h.vocab_hash_offset);
+  fwrite(vocab_hash, sizeof(int), vocab_hash_size, fo);
+  CachePad(fo, h.lemma_hash_offset);
+  fwrite(lemma_hash, sizeof(int), vocab_hash_size, fo);
+  CachePad(fo, h.strings_offset);
+  for (a = 0; a < vocab_size; a++) fwrite(vocab[a].word, 1, strlen(vocab[a].word) + 1, fo);
+  for (a = 0; a < lemmas_size; a++) fwrite(lemmas[a].lemma, 1, strlen(lemmas[a].lemma) + 1, fo);
+  if (fclose(fo) != 0 || rename(tmp_file, vocab_cache_file) != 0) {
+    printf("ERROR: cannot write vocabulary cache %s\n", vocab_cache_file);
+    exit(1);
+  }
+  if (debug_mode > 0) printf("Saved vocabulary cache %s\n", vocab_cache_file);
+}
+
+// Maps a vocabulary cache written by SaveVocabCache(); strings and hash tables are used in place
+// and only the small per-entry structs are filled in
+void ReadVocabCache() {
+  struct vocab_cache_header *h;
+  struct lemma_count *pool;
+  struct stat st;
+  long long a, b, *cn, *str, *pair_start, *pair_cn;
+  int *pair_lemma, fd;
+  char *base, *strings;
+  FILE *fin;
+  fd = open(vocab_cache_file, O_RDONLY);
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    printf("ERROR: cannot open vocabulary cache %s\n", vocab_cache_file);
+    exit(1);
+  }
+  if (st.st_size < (long long)sizeof(struct vocab_cache_header)) {
+    printf("ERROR: vocabulary cache %s is truncated\n", vocab_cache_file);
+    exit(1);
+  }
+  // Private mapping: pages are shared with the page cache until something writes to them
+  base = (char *)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("ERROR: cannot map vocabulary cache %s\n", vocab_cache_file);
+    exit(1);
+  }
+  h = (struct vocab_cache_header *)base;
+  if (memcmp(h->magic, "W2VMVOC", 8) || h->version != VOCAB_CACHE_VERSION) {
+    printf("ERROR: %s is not a vocabulary cache of this version\n", vocab_cache_file);
+    exit(1);
+  }
+  if (h->strings_offset + h->strings_size > st.st_size) {
+    printf("ERROR: vocabulary cache %s is truncated\n", vocab_cache_file);
+    exit(1);
+  }
+  if (h->min_count != min_count) {
+    printf("ERROR: vocabulary cache %s was built with -min-count %lld; remove it or pass the same value\n", vocab_cache_file, h->min_count);
+    exit(1);
+  }
+  strings = base + h->strings_offset;
+  vocab_hash_size = h->hash_size;
+  free(vocab_hash);
+  free(lemma_hash);
+  vocab_hash = (int *)(base + h->vocab_hash_offset);
+  lemma_hash = (int *)(base + h->lemma_hash_offset);
+  hash_tables_mapped = 1;
+  vocab_size = h->vocab_size;
+  vocab_max_size = vocab_size + 1;
+  vocab = (struct vocab_word *)realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+  vocab_cn = (long long *)realloc(vocab_cn, vocab_max_size * sizeof(long long));
+  memcpy(vocab_cn, base + h->vocab_cn_offset, vocab_size * sizeof(long long));
+  str = (long long *)(base + h->vocab_str_offset);
+  for (a = 0; a < vocab_size; a++) {
+    vocab[a].word = strings + str[a];
+    vocab[a].lemma_counts = NULL;
+  }
+  lemmas_size = h->lemmas_size;
+  lemmas_max_size = lemmas_size + 1;
+  lemmas = (struct lemma_struct *)realloc(lemmas, lemmas_max_size * sizeof(struct lemma_struct));
+  cn = (long long *)(base + h->lemma_cn_offset);
+  str = (long long *)(base + h->lemma_str_offset);
+  for (a = 0; a < lemmas_size; a++) {
+    lemmas[a].cn = cn[a];
+    lemmas[a].lemma = strings + str[a];
+  }
+  // Rebuild the per-word lemma lists on top of one allocation
+  pair_start = (long long *)(base + h->pair_start_offset);
+  pair_lemma = (int *)(base + h->pair_lemma_offset);
+  pair_cn = (long long *)(base + h->pair_cn_offset);
+  word_lemma_counts = (struct lemma_count *)calloc(vocab_size, sizeof(struct lemma_count));
+  pool = (struct lemma_count *)calloc(h->pairs_size + 1, sizeof(struct lemma_count));
+  for (a = 0; a < vocab_size; a++) {
+    if (pair_start[a] == pair_start[a + 1]) {
+      word_lemma_counts[a].lemma = -1;
+      continue;
+    }
+    for (b = pair_start[a]; b < pair_start[a + 1]; b++) {
+      pool[b].lemma = pair_lemma[b];
+      pool[b].cn = pair_cn[b];
+      pool[b].next = (b + 1 < pair_start[a + 1]) ? &pool[b + 1] : NULL;
+    }
+    word_lemma_counts[a] = pool[pair_start[a]];
+  }
+  count_lemmas_in_training = 0;
+  train_words = h->train_words;
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("Number of lemmas: %lld\n", lemmas_size);
+    printf("Words in train file: %lld\n", train_words);
+  }
+  fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  fseek(fin, 0, SEEK_END);
+  file_size = ftell(fin);
+  fclose(fin);
+  // Caches merged from count shards do not belong to a single training file
+  if (h->file_size != 0 && file_size != h->file_size && continue_file[0] == 0) printf("WARNING: training file size differs from the one the vocabulary cache %s was built from\n", vocab_cache_file);
+}
+
+// Adds the words and lemmas of a new training file to the vocabulary of an earlier run, read from
+// the cache. Existing entries keep their positions, so their trained rows stay valid; new words
+// reaching min_count are appended in order of frequency and new lemmas are appended as they come.
+// Afterwards train_words only counts the new file, which is all that is trained on
+void ExtendVocabFromTrainFile() {
+  char word[MAX_STRING], lemma[MAX_STRING], eof = 0;
+  struct lemma_count *node;
+  long long a, i, j, *old_cn;
+  FILE *fin;
+  if (vocab_cache_file[0] == 0 || access(vocab_cache_file, R_OK) != 0) {
+    printf("ERROR: -continue needs the vocabulary cache of the earlier run (-vocab-cache)\n");
+    exit(1);
+  }
+  ReadVocabCache();
+  old_vocab_size = vocab_size;
+  old_lemmas_size = lemmas_size;
+  old_cn = (long long *)malloc(vocab_size * sizeof(long long));
+  memcpy(old_cn, vocab_cn, vocab_size * sizeof(long long));
+  // Move the word-lemma counts back into per-word lists so the new pairs can be added to them
+  for (a = 0; a < vocab_size; a++) if (word_lemma_counts[a].lemma != -1) {
+    node = CreateNode(word_lemma_counts[a].lemma, word_lemma_counts[a].next);
+    node->cn = word_lemma_counts[a].cn;
+    vocab[a].lemma_counts = node;
+  }
+  free(word_lemma_counts);
+  fin = fopen(train_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: training data file not found!\n");
+    exit(1);
+  }
+  while (1) {
+    ReadWordLemma(word, lemma, fin, &eof);
+    if (eof) break;
+    i = SearchVocab(word);
+    j = SearchLemmas(lemma);
+    if (i == -1) i = AddWordToVocab(word);
+    vocab_cn[i]++;
+    if (j == -1) {
+      j = AddLemmaToLemmas(lemma);
+      lemmas[j].cn = 0;
+    }
+    lemmas[j].cn++;
+    AddWordLemmaCount(i, j, 1);
+    if (vocab_size > vocab_hash_size * 0.7 || lemmas_size > vocab_hash_size * 0.7) GrowHashTables();
+  }
+  file_size = ftell(fin);
+  fclose(fin);
+  SortVocabFrom(old_vocab_size);
+  BuildWordLemmaCounts();
+  train_words = 0;
+  for (a = 0; a < vocab_size; a++) train_words += vocab_cn[a] - (a < old_vocab_size ? old_cn[a] : 0);
+  free(old_cn);
+  if (debug_mode > 0) {
+    printf("New words: %lld (vocab size %lld)\n", vocab_size - old_vocab_size, vocab_size);
+    printf("New lemmas: %lld (number of lemmas %lld)\n", lemmas_size - old_lemmas_size, lemmas_size);
+    printf("Words in train file: %lld\n", train_words);
+  }
+}
+
+// Counts the training file and saves the raw counts as a shard for MergeCountShards()
+void SaveCountShard() {
+  struct count_shard_header h;
+  struct lemma_count *cursor;
+  long long a;
+  int pair[2];
+  FILE *fo;
+  CountTrainFile();
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "W2VMSHD", 8);
+  h.version = COUNT_SHARD_VERSION;
+  h.vocab_size = vocab_size;
+  h.lemmas_size = lemmas_size;
+  h.train_words = train_words;
+  h.file_size = file_size;
+  for (a = 0; a < vocab_size; a++) {
+    for (cursor = vocab[a].lemma_counts; cursor != NULL; cursor = cursor->next) h.pairs_size++;
+    h.strings_size += strlen(vocab[a].word) + 1;
+  }
+  for (a = 0; a < lemmas_size; a++) h.strings_size += strlen(lemmas[a].lemma) + 1;
+  fo = fopen(count_shard_file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot write count shard %s\n", count_shard_file);
+    exit(1);
+  }
+  fwrite(&h, sizeof(h), 1, fo);
+  fwrite(vocab_cn, sizeof(long long), vocab_size, fo);
+  for (a = 0; a < lemmas_size; a++) fwrite(&lemmas[a].cn, sizeof(long long), 1, fo);
+  for (a = 0; a < vocab_size; a++) for (cursor = vocab[a].lemma_counts; cursor != NULL; cursor = cursor->next) {
+    pair[0] = a;
+    pair[1] = cursor->lemma;
+    fwrite(pair, sizeof(int), 2, fo);
+    fwrite(&cursor->cn, sizeof(long long), 1, fo);
+  }
+  for (a = 0; a < vocab_size; a++) fwrite(vocab[a].word, 1, strlen(vocab[a].word) + 1, fo);
+  for (a = 0; a < lemmas_size; a++) fwrite(lemmas[a].lemma, 1, strlen(lemmas[a].lemma) + 1, fo);
+  if (fclose(fo) != 0) {
+    printf("ERROR: cannot write count shard %s\n", count_shard_file);
+    exit(1);
+  }
+  if (debug_mode > 0) printf("Saved count shard %s: %lld words, %lld lemmas, %lld words in train file\n",
+    count_shard_file, vocab_size, lemmas_size, train_words);
+}
+
+// Sums the count shards listed (comma separated) in merge_shards, applies min-count
+// and saves the result as the vocabulary cache
+void MergeCountShards() {
+  struct count_shard_header h;
+  long long a, i, *cn, *word_index, *lemma_index, pair_cn, total_words = 0;
+  int pair[2];
+  char *shards = strdup(merge_shards), *shard, *strings, *str;
+  FILE *fin;
+  if (vocab_cache_file[0] == 0) {
+    printf("ERROR: -merge-shards needs -vocab-cache for the merged vocabulary\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
+  for (a = 0; a < vocab_hash_size; a++) lemma_hash[a] = -1;
+  vocab_size = 0;
+  lemmas_size = 0;
+  AddWordToVocab((char *)"</s>");
+  AddLemmaToLemmas((char *)"</s>");
+  for (shard = strtok(shards, ","); shard != NULL; shard = strtok(NULL, ",")) {
+    fin = fopen(shard, "rb");
+    if (fin == NULL) {
+      printf("ERROR: count shard %s not found\n", shard);
+      exit(1);
+    }
+    if (fread(&h, sizeof(h), 1, fin) != 1 || memcmp(h.magic, "W2VMSHD", 8) || h.version != COUNT_SHARD_VERSION) {
+      printf("ERROR: %s is not a count shard of this version\n", shard);
+      exit(1);
+    }
+    // Grow the hash tables before a shard is merged rather than prune, so that no counts are lost
+    // before min_count is applied to the sums of all shards
+    while (vocab_size + h.vocab_size > vocab_hash_size * 0.7 || lemmas_size + h.lemmas_size > vocab_hash_size * 0.7) GrowHashTables();
+    cn = (long long *)malloc((h.vocab_size + h.lemmas_size) * sizeof(long long));
+    word_index = (long long *)malloc(h.vocab_size * sizeof(long long));
+    lemma_index = (long long *)malloc(h.lemmas_size * sizeof(long long));
+    strings = (char *)malloc(h.strings_size);
+    if (cn == NULL || word_index == NULL || lemma_index == NULL || strings == NULL) {
+      printf("Memory allocation failed\n");
+      exit(1);
+    }
+    if (fread(cn, sizeof(long long), h.vocab_size + h.lemmas_size, fin) != h.vocab_size + h.lemmas_size) {
+      printf("ERROR: count shard %s is truncated\n", shard);
+      exit(1);
+    }
+    // Strings follow the pairs; read them first to map shard positions to merged positions
+    fseek(fin, h.pairs_size * (2 * sizeof(int) + sizeof(long long)), SEEK_CUR);
+    if (fread(strings, 1, h.strings_size, fin) != h.strings_size) {
+      printf("ERROR: count shard %s is truncated\n", shard);
+      exit(1);
+    }
+    str = strings;
+    for (a = 0; a < h.vocab_size; a++) {
+      i = SearchVocab(str);
+      if (i == -1) i = AddWordToVocab(str);
+      vocab_cn[i] += cn[a];
+      word_index[a] = i;
+      str += strlen(str) + 1;
+    }
+    for (a = 0; a < h.lemmas_size; a++) {
+      i = SearchLemmas(str);
+      if (i == -1) {
+        i = AddLemmaToLemmas(str);
+        lemmas[i].cn = 0;
+      }
+      lemmas[i].cn += cn[h.vocab_size + a];
+      lemma_index[a] = i;
+      str += strlen(str) + 1;
+    }
+    fseek(fin, sizeof(h) + (h.vocab_size + h.lemmas_size) * sizeof(long long), SEEK_SET);
+    for (a = 0; a < h.pairs_size; a++) {
+      if (fread(pair, sizeof(int), 2, fin) != 2 || fread(&pair_cn, sizeof(long long), 1, fin) != 1) {
+        printf("ERROR: count shard %s is truncated\n", shard);
+        exit(1);
+      }
+      AddWordLemmaCount(word_index[pair[0]], lemma_index[pair[1]], pair_cn);
+    }
+    fclose(fin);
+    total_words += h.train_words;
+    if (debug_mode > 0) printf("Merged count shard %s: %lld words in shard\n", shard, h.train_words);
+    free(cn);
+    free(word_index);
+    free(lemma_index);
+    free(strings);
+  }
+  free(shards);
+  SortVocab();
+  BuildWordLemmaCounts();
+  if (debug_mode > 0) {
+    printf("Vocab size: %lld\n", vocab_size);
+    printf("Number of lemmas: %lld\n", lemmas_size);
+    printf("Words in all shards: %lld\n", total_words);
+  }
+  file_size = 0;
+  SaveVocabCache();
+}
+
+// Reads a sysfs CPU list such as "0-3,8-11" and keeps the CPUs this process may run on
+int ReadCpuList(char *file, cpu_set_t *allowed, int *cpus, int max_cpus) {
+  int first, last, n = 0;
+  char sep;
+  FILE *fin = fopen(file, "rb");
+  if (fin == NULL) return -1;
+  while (fscanf(fin, "%d", &first) == 1) {
+    last = first;
+    sep = fgetc(fin);
+    if (sep == '-') {
+      if (fscanf(fin, "%d", &last) != 1) break;
+      sep = fgetc(fin);
+    }
+    for (; first <= last; first++) if (n < max_cpus && CPU_ISSET(first, allowed)) cpus[n++] = first;
+    if (sep != ',') break;
+  }
+  fclose(fin);
+  return n;
+}
+
+// Returns the CPUs that the CFS quota of one cgroup directory allows, or 0 if it sets none. cgroup v2
+// keeps quota and period in cpu.max, v1 in cpu.cfs_quota_us and cpu.cfs_period_us
+long long CgroupQuotaCpus(char *dir, int v1) {
+  char file[3 * MAX_STRING];
+  long long quota = -1, period = 0;
+  FILE *fin;
+  sprintf(file, v1 ? "%s/cpu.cfs_quota_us" : "%s/cpu.max", dir);
+  fin = fopen(file, "rb");
+  if (fin == NULL) return 0;
+  // "max <period>" and -1 mean no quota
+  if (fscanf(fin, "%lld", &quota) != 1) quota = -1;
+  if (!v1 && fscanf(fin, "%lld", &period) != 1) period = 0;
+  fclose(fin);
+  if (v1) {
+    sprintf(file, "%s/cpu.cfs_period_us", dir);
+    fin = fopen(file, "rb");
+    if (fin == NULL) return 0;
+    if (fscanf(fin, "%lld", &period) != 1) period = 0;
+    fclose(fin);
+  }
+  return quota > 0 && period > 0 ? (quota + period - 1) / period : 0;
+}
+
+// Lowers limit to the smallest quota of the cgroup at path under the hierarchy mounted at mount and of
+// its ancestors up to the root; inside a container the path may name cgroups of the host that are not visible
+long long CgroupCpuLimit(char *mount, char *cgroup, int v1, long long limit) {
+  char path[MAX_STRING], dir[2 * MAX_STRING], *slash;
+  long long cpus;
+  strcpy(path, cgroup);
+  while (1) {
+    sprintf(dir, "%s%s", mount, strcmp(path, "/") ? path : "");
+    cpus = CgroupQuotaCpus(dir, v1);
+    if (cpus > 0 && (limit == 0 || cpus < limit)) limit = cpus;
+    slash = strrchr(path, '/');
+    if (slash == NULL || !strcmp(path, "/")) break;
+    if (slash == path) strcpy(path, "/");
+    else *slash = 0;
+  }
+  return limit;
+}
+
+// Returns the number of CPUs this process may use: those of its affinity mask, capped by the CFS quotas of its
+// cgroup and the cgroups above it (cpu.max in cgroup v2, cpu.cfs_quota_us in v1), since containers
+// often see more CPUs than their quota lets them use
+int AvailableCpus(int print) {
+  char line[MAX_STRING], list[MAX_STRING + 2], mount[2 * MAX_STRING], *controllers, *path, *end;
+  long long limit = 0;
+  int cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t allowed;
+  FILE *fin;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) cpus = CPU_COUNT(&allowed);
+  // Lines of /proc/self/cgroup are "<id>:<controllers>:<path>"; the v2 one has no controllers, the v1 one
+  // we want lists cpu, e.g. "4:cpu,cpuacct:/system.slice", and is mounted under the controller names
+  fin = fopen("/proc/self/cgroup", "rb");
+  if (fin != NULL) {
+    while (fgets(line, MAX_STRING, fin) != NULL) {
+      controllers = strchr(line, ':');
+      if (controllers == NULL) continue;
+      path = strchr(++controllers, ':');
+      if (path == NULL) continue;
+      *path++ = 0;
+      if ((end = strchr(path, '\n')) != NULL) *end = 0;
+      if (controllers[0] == 0) limit = CgroupCpuLimit((char *)"/sys/fs/cgroup", path, 0, limit);
+      sprintf(list, ",%s,", controllers);
+      if (strstr(list, ",cpu,") != NULL) {
+        sprintf(mount, "/sys/fs/cgroup/%s", controllers);
+        if (access(mount, F_OK) != 0) strcpy(mount, "/sys/fs/cgroup/cpu");
+        limit = CgroupCpuLimit(mount, path, 1, limit);
+      }
+    }
+    fclose(fin);
+  }
+  if (limit > 0 && limit < cpus) {
+    if (print) printf("The CPU quota of the cgroup allows %lld of %d CPUs\n", limit, cpus);
+    cpus = limit;
+  }
+  return cpus > 0 ? cpus : 1;
+}
+
+// Finds the NUMA nodes with CPUs available to us and assigns every training thread a CPU,
+// spreading consecutive threads over the nodes
+void InitTopology() {
+  int node, n, t, found = 0, node_cpus[CPU_SETSIZE], *cpus = (int *)calloc(CPU_SETSIZE, sizeof(int));
+  int *first = (int *)calloc(CPU_SETSIZE + 1, sizeof(int)), *count = (int *)calloc(CPU_SETSIZE, sizeof(int));
+  char file[MAX_STRING];
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    CPU_ZERO(&allowed);
+    for (t = 0; t < num_threads; t++) CPU_SET(t, &allowed);
+  }
+  numa_nodes = 0;
+  for (node = 0; node < CPU_SETSIZE; node++) {
+    sprintf(file, "/sys/devices/system/node/node%d/cpulist", node);
+    n = ReadCpuList(file, &allowed, node_cpus, CPU_SETSIZE - found);
+    if (n == -1) {
+      if (access("/sys/devices/system/node", F_OK) == 0 && node < 64) continue;   // Node numbers may have gaps
+      break;
+    }
+    if (n == 0) continue;
+    memcpy(cpus + found, node_cpus, n * sizeof(int));
+    first[numa_nodes] = found;
+    count[numa_nodes] = n;
+    found += n;
+    numa_nodes++;
+  }
+  if (numa_nodes == 0) {
+    // No sysfs topology: a single node holding every allowed CPU
+    for (t = 0; t < CPU_SETSIZE; t++) if (CPU_ISSET(t, &allowed)) cpus[found++] = t;
+    first[0] = 0;
+    count[0] = found;
+    numa_nodes = 1;
+  }
+  if (numa_nodes > num_threads) numa_nodes = num_threads;
+  free(thread_cpu);
+  thread_cpu = (int *)malloc(num_threads * sizeof(int));
+  for (t = 0; t < num_threads; t++) {
+    node = t % numa_nodes;
+    thread_cpu[t] = cpus[first[node] + (t / numa_nodes) % count[node]];
+  }
+  free(cpus);
+  free(first);
+  free(count);
+}
+
+// Pins the calling thread to the CPU assigned to training thread id
+void PinThread(long long id) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(thread_cpu[id], &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0 && debug_mode > 0)
+    printf("WARNING: cannot pin thread %lld to CPU %d\n", id, thread_cpu[id]);
+}
+
+// Maps <mmap_dir>/<name>.mat as the backing store of a matrix. Pages are written back by the kernel
+// under memory pressure, so the matrices may be larger than RAM. The mapping is shared, so forked
+// checkpoints of file-backed matrices see updates made while they are written
+real *MapMatrixFile(long long rows, long long cols, char *name) {
+  struct matrix_file_header *h;
+  char file[2 * MAX_STRING + 8];
+  long long bytes = MATRIX_FILE_HEADER + rows * cols * sizeof(real);
+  char *base;
+  int fd, err;
+  sprintf(file, "%s/%s.mat", mmap_dir, name);
+  fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("ERROR: cannot create matrix file %s\n", file);
+    exit(1);
+  }
+  // Reserve the blocks now rather than failing on a page fault in the middle of training
+  err = posix_fallocate(fd, 0, bytes);
+  if (err != 0) {
+    printf("ERROR: cannot reserve %lld MB for matrix file %s: %s\n", bytes >> 20, file, strerror(err));
+    exit(1);
+  }
+  base = (char *)mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("ERROR: cannot map matrix file %s\n", file);
+    exit(1);
+  }
+  h = (struct matrix_file_header *)base;
+  memcpy(h->magic, "W2VMMAT", 8);
+  h->version = MATRIX_FILE_VERSION;
+  h->rows = rows;
+  h->cols = cols;
+  h->complete = 0;
+  matrix_files = (struct matrix_file *)realloc(matrix_files, (num_matrix_files + 1) * sizeof(struct matrix_file));
+  matrix_files[num_matrix_files].base = base;
+  matrix_files[num_matrix_files].bytes = bytes;
+  num_matrix_files++;
+  return (real *)(base + MATRIX_FILE_HEADER);
+}
+
+// Writes the matrix files back and marks them complete, so they hold the trained parameters
+void SyncMatrixFiles() {
+  struct matrix_file_header *h;
+  double begin = GetTime();
+  int a;
+  for (a = 0; a < num_matrix_files; a++) {
+    h = (struct matrix_file_header *)matrix_files[a].base;
+    if (msync(matrix_files[a].base, matrix_files[a].bytes, MS_SYNC) != 0) {
+      printf("WARNING: writing back matrix file %lld x %lld failed\n", h->rows, h->cols);
+      continue;
+    }
+    h->complete = 1;
+    msync(matrix_files[a].base, MATRIX_FILE_HEADER, MS_SYNC);
+  }
+  if (debug_mode > 0 && num_matrix_files > 0) printf("Wrote back %d matrix files in %.2fs\n", num_matrix_files, GetTime() - begin);
+}
+
+// Allocates a parameter matrix without touching it, so the initializing threads decide where its pages go
+real *AllocMatrix(long long rows, long long cols, char *name) {
+  void *p = NULL;
+  long long bytes = rows * cols * sizeof(real), rounded = (bytes + INIT_CHUNK - 1) / INIT_CHUNK * INIT_CHUNK;
+  if (mmap_dir[0] != 0) return MapMatrixFile(rows, cols, name);
+  if (huge_pages == 2) {
+    p = mmap(NULL, rounded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED) return (real *)p;
+    printf("WARNING: no explicit huge pages left for %s, using transparent huge pages\n", name);
+    p = NULL;
+  }
+  if (posix_memalign(&p, huge_pages ? INIT_CHUNK : 128, huge_pages ? rounded : bytes) != 0) p = NULL;
+  if (p == NULL) {printf("Memory allocation failed\n"); exit(1);}
+  if (huge_pages) madvise(p, rounded, MADV_HUGEPAGE);
+  return (real *)p;
+}
+
+// Rows are sorted by frequency, so the rows of the most frequent words are a short prefix of a
+// matrix file: prefetch it and turn off readahead for the long tail of rare words
+void AdviseRows(real *m, long long rows, long long cols, long long hot_rows) {
+  long long page_size = sysconf(_SC_PAGESIZE), bytes = rows * cols * sizeof(real);
+  long long hot = (hot_rows * cols * sizeof(real) + page_size - 1) / page_size * page_size;
+  if (hot > bytes) hot = bytes;
+  if (hot > 0) madvise(m, hot, MADV_WILLNEED);
+  if (hot < bytes) madvise((char *)m + hot, bytes - hot, MADV_RANDOM);
+}
+
+// Returns the number of leading vocabulary rows that cover HOT_ROW_SHARE of the counted words
+long long HotRows() {
+  long long a, sum = 0, covered = 0;
+  for (a = 0; a < vocab_size; a++) sum += vocab_cn[a];
+  for (a = 0; a < vocab_size && covered < sum * HOT_ROW_SHARE; a++) covered += vocab_cn[a];
+  return a;
+}
+
+// Returns the init thread that first touches a chunk of a matrix, which places the chunk
+// on that thread's node once the init threads are pinned
+long long ChunkOwner(long long chunk, long long chunks) {
+  long long node, threads_on_node;
+  if (numa_policy == NUMA_NONE || numa_nodes == 1) return chunk % num_threads;
+  if (numa_policy == NUMA_INTERLEAVE) node = chunk % numa_nodes;
+  else node = chunk * numa_nodes / chunks;
+  threads_on_node = (num_threads - node + numa_nodes - 1) / numa_nodes;
+  return node + (chunk / numa_nodes % threads_on_node) * numa_nodes;
+}
+
+// Initializes the chunks of a matrix owned by one thread; random values only depend on the
+// element position, so the result is the same for any thread count and placement
+void InitMatrixChunks(real *m, long long n, long long cols, unsigned long long salt, long long id) {
+  long long c, e, end, per_chunk = INIT_CHUNK / sizeof(real), chunks = (n + per_chunk - 1) / per_chunk;
+  unsigned long long next_random;
+  for (c = 0; c < chunks; c++) {
+    if (ChunkOwner(c, chunks) != id) continue;
+    end = (c + 1) * per_chunk;
+    if (end > n) end = n;
+    if (salt == 0) {
+      // Fresh matrix files already read as zeros
+      if (mmap_dir[0] == 0) memset(m + c * per_chunk, 0, (end - c * per_chunk) * sizeof(real));
+      continue;
+    }
+    for (e = c * per_chunk; e < end; e++) {
+      next_random = MixBits(salt ^ (unsigned long long)e);
+      m[e] = (((next_random & 0xFFFF) / (real)65536) - 0.5) / cols;
+    }
+  }
+}
+
+void *InitNetThread(void *id) {
+  if (numa_policy != NUMA_NONE || pin_threads) PinThread((long long)id);
+  InitMatrixChunks(syn0_w, vocab_size * layer1_w_size, layer1_w_size, (1ULL << 56) | RandomStream(1) >> 8, (long long)id);
+  InitMatrixChunks(syn0_l, lemmas_size * layer1_l_size, layer1_l_size, (2ULL << 56) | RandomStream(2) >> 8, (long long)id);
+  if (hs) InitMatrixChunks(syn1, vocab_size * layer1_size, layer1_size, 0, (long long)id);
+  if (negative > 0) InitMatrixChunks(syn1neg, vocab_size * layer1_size, layer1_size, 0, (long long)id);
+  pthread_exit(NULL);
+}
+
+// Samples the pages of a matrix to find the share placed on each node; returns the share of
+// accesses from pinned training threads that stay on their own node, or -1 if unknown
+double ReportPlacement(char *name, real *m, long long bytes) {
+  long long a, samples, page_size = sysconf(_SC_PAGESIZE), pages = (bytes + page_size - 1) / page_size, placed = 0;
+  long long *on_node = (long long *)calloc(numa_nodes, sizeof(long long));
+  void *addr[MAX_PLACEMENT_SAMPLES];
+  int status[MAX_PLACEMENT_SAMPLES];
+  double share, local = 0;
+  samples = pages < MAX_PLACEMENT_SAMPLES ? pages : MAX_PLACEMENT_SAMPLES;
+  for (a = 0; a < samples; a++) addr[a] = (char *)m + (pages * a / samples) * page_size;
+  if (syscall(SYS_move_pages, 0, samples, addr, NULL, status, 0) != 0) {
+    printf("%s: page placement unavailable\n", name);
+    free(on_node);
+    return -1;
+  }
+  for (a = 0; a < samples; a++) if (status[a] >= 0 && status[a] < numa_nodes) {
+    on_node[status[a]]++;
+    placed++;
+  }
+  printf("%s: %lld MB, pages per node:", name, bytes >> 20);
+  for (a = 0; a < numa_nodes; a++) {
+    share = placed ? on_node[a] / (double)placed : 0;
+    printf(" %.1f%%", share * 100);
+    // Threads of node a, which access rows uniformly, find this share of the matrix local
+    local += share * ((num_threads - a + numa_nodes - 1) / numa_nodes) / (double)num_threads;
+  }
+  printf("\n");
+  free(on_node);
+  return local;
+}
+
+void InitNet() {
+  long long a, hot_rows;
+  double init_start = GetTime(), local, local_sum = 0;
+  int reported = 0;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  syn0_w = AllocMatrix(vocab_size, layer1_w_size, "syn0_w");
+  syn0_l = AllocMatrix(lemmas_size, layer1_l_size, "syn0_l");
+  if (hs) syn1 = AllocMatrix(vocab_size, layer1_size, "syn1");
+  if (negative > 0) syn1neg = AllocMatrix(vocab_size, layer1_size, "syn1neg");
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, InitNetThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+  if (mmap_dir[0] != 0) {
+    hot_rows = HotRows();
+    AdviseRows(syn0_w, vocab_size, layer1_w_size, hot_rows);
+    if (hs) AdviseRows(syn1, vocab_size, layer1_size, hot_rows);
+    if (negative > 0) AdviseRows(syn1neg, vocab_size, layer1_size, hot_rows);
+    if (debug_mode > 0) printf("Matrices mapped from %s; the first %lld rows cover %.0f%% of the words\n", mmap_dir, hot_rows, HOT_ROW_SHARE * 100);
+  }
+  if (debug_mode > 0) {
+    printf("Initialized parameters in %.2fs with %d threads on %d NUMA node(s)\n", GetTime() - init_start, num_threads, numa_nodes);
+    if (numa_nodes > 1) {
+      local = ReportPlacement("syn0_w", syn0_w, (long long)vocab_size * layer1_w_size * sizeof(real));
+      if (local >= 0) {local_sum += local; reported++;}
+      local = ReportPlacement("syn0_l", syn0_l, (long long)lemmas_size * layer1_l_size * sizeof(real));
+      if (local >= 0) {local_sum += local; reported++;}
+      if (hs) local = ReportPlacement("syn1", syn1, (long long)vocab_size * layer1_size * sizeof(real));
+      if (hs && local >= 0) {local_sum += local; reported++;}
+      if (negative > 0) local = ReportPlacement("syn1neg", syn1neg, (long long)vocab_size * layer1_size * sizeof(real));
+      if (negative > 0 && local >= 0) {local_sum += local; reported++;}
+      if (pin_threads && reported) printf("Expected share of cross-node parameter accesses: %.1f%%\n", (1 - local_sum / reported) * 100);
+      else if (!pin_threads) printf("Training threads are not pinned (-pin-threads 1), so their parameter accesses may cross nodes\n");
+    }
+  }
+  if (hs) CreateBinaryTree();
+}
+
+void *CopyReplicaThread(void *id) {
+  long long r = (long long)id;
+  // Runs on a CPU of the replica's node, so the first touch of the copy places it there
+  PinThread(r);
+  memcpy(replica_syn0_w[r], syn0_w, (long long)vocab_size * layer1_w_size * sizeof(real));
+  memcpy(replica_syn0_l[r], syn0_l, (long long)lemmas_size * layer1_l_size * sizeof(real));
+  if (negative > 0) memcpy(replica_syn1neg[r], syn1neg, (long long)vocab_size * layer1_size * sizeof(real));
+  pthread_exit(NULL);
+}
+
+// Gives every group of training threads its own copy of the parameters; replica 0 is the original
+void InitReplicas() {
+  long long r, bytes = ((long long)vocab_size * layer1_w_size + (long long)lemmas_size * layer1_l_size) * sizeof(real);
+  pthread_t *pt = (pthread_t *)malloc(num_replicas * sizeof(pthread_t));
+  char name[32];
+  if (negative > 0) bytes += (long long)vocab_size * layer1_size * sizeof(real);
+  replica_syn0_w = (real **)malloc(num_replicas * sizeof(real *));
+  replica_syn0_l = (real **)malloc(num_replicas * sizeof(real *));
+  replica_syn1neg = (real **)malloc(num_replicas * sizeof(real *));
+  replica_syn0_w[0] = syn0_w;
+  replica_syn0_l[0] = syn0_l;
+  replica_syn1neg[0] = syn1neg;
+  if (num_replicas > 1 && debug_mode > 0) {
+    printf("Training %d replicas, averaged every %lld words: %lld MB of extra parameter memory\n",
+      num_replicas, average_every, (num_replicas - 1) * bytes >> 20);
+    if (!pin_threads) printf("WARNING: replicas only stay local to their threads with -pin-threads 1\n");
+  }
+  for (r = 1; r < num_replicas; r++) {
+    sprintf(name, "syn0_w.%lld", r);
+    replica_syn0_w[r] = AllocMatrix(vocab_size, layer1_w_size, name);
+    sprintf(name, "syn0_l.%lld", r);
+    replica_syn0_l[r] = AllocMatrix(lemmas_size, layer1_l_size, name);
+    sprintf(name, "syn1neg.%lld", r);
+    if (negative > 0) replica_syn1neg[r] = AllocMatrix(vocab_size, layer1_size, name);
+    pthread_create(&pt[r], NULL, CopyReplicaThread, (void *)r);
+  }
+  for (r = 1; r < num_replicas; r++) pthread_join(pt[r], NULL);
+  free(pt);
+}
+
+// Replaces the elements first to last - 1 of a replicated matrix by their means over the replicas
+void AverageMatrix(real **replica, long long first, long long last) {
+  long long e, r;
+  real sum, scale = 1.0 / num_replicas;
+  for (e = first; e < last; e++) {
+    sum = 0;
+    for (r = 0; r < num_replicas; r++) sum += replica[r][e];
+    sum *= scale;
+    for (r = 0; r < num_replicas; r++) replica[r][e] = sum;
+  }
+}
+
+void AverageReplicas() {
+  double begin = GetTime();
+  AverageMatrix(replica_syn0_w, 0, (long long)vocab_size * layer1_w_size);
+  AverageMatrix(replica_syn0_l, 0, (long long)lemmas_size * layer1_l_size);
+  if (negative > 0) AverageMatrix(replica_syn1neg, 0, (long long)vocab_size * layer1_size);
+  TraceSpan(training_done ? trace_main : trace_averaging, "average replicas", begin);
+  averaging_time += GetTime() - begin;
+  averaging_rounds++;
+}
+
+// Averages the replicas each time the training threads have processed another average_every words;
+// updates made while a row is being averaged may be lost, as with any Hogwild race
+void *AverageReplicasThread(void *unused) {
+  long long next = average_every;
+  while (!training_done) {
+    if (word_count_actual < next) {
+      usleep(1000);
+      continue;
+    }
+    AverageReplicas();
+    next = word_count_actual + average_every;
+  }
+  pthread_exit(NULL);
+}
+
+// Ends a round of -deterministic training. Every thread has trained its own replica on the same
+// number of words of its shard; now each averages a slice of the replicas, and the learning rate
+// follows the count of finished rounds instead of the timing of the monitor
+void FinishRound(long long id) {
+  long long n;
+  double begin = GetTime();
+  if (pthread_barrier_wait(&round_barrier) == PTHREAD_BARRIER_SERIAL_THREAD) {
+    rounds_done++;
+    if (alpha_schedule == ALPHA_LINEAR) {
+      alpha = starting_alpha * (1 - rounds_done / (real)(iter * rounds_per_epoch));
+      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+    }
+  }
+  if (num_replicas > 1) {
+    n = vocab_size * layer1_w_size;
+    AverageMatrix(replica_syn0_w, n * id / num_threads, n * (id + 1) / num_threads);
+    n = lemmas_size * layer1_l_size;
+    AverageMatrix(replica_syn0_l, n * id / num_threads, n * (id + 1) / num_threads);
+    n = vocab_size * layer1_size;
+    if (negative > 0) AverageMatrix(replica_syn1neg, n * id / num_threads, n * (id + 1) / num_threads);
+  }
+  pthread_barrier_wait(&round_barrier);
+  TraceSpan(id, "round", begin);
+}
+
+void SendAll(int fd, void *data, long long bytes) {
+  long long n, done = 0;
+  while (done < bytes) {
+    n = send(fd, (char *)data + done, bytes - done, MSG_NOSIGNAL);
+    if (n <= 0) {
+      printf("\nERROR: lost the connection while sending parameters\n");
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+void RecvAll(int fd, void *data, long long bytes) {
+  long long n, done = 0;
+  while (done < bytes) {
+    n = recv(fd, (char *)data + done, bytes - done, 0);
+    if (n <= 0) {
+      printf("\nERROR: lost the connection while receiving parameters\n");
+      exit(1);
+    }
+    done += n;
+  }
+}
+
+// Number of parameters exchanged in a round: only the first sync_rows vocabulary rows of syn0_w and
+// syn1neg, the frequent ones, unless full; syn0_l is not sorted by frequency and always goes whole
+long long SyncLength(int full, long long *w, long long *l, long long *n) {
+  long long rows = (full || sync_rows == 0 || sync_rows > vocab_size) ? vocab_size : sync_rows;
+  *w = rows * layer1_w_size;
+  *l = lemmas_size * layer1_l_size;
+  *n = negative > 0 ? rows * layer1_size : 0;
+  return *w + *l + *n;
+}
+
+// Runs a multi-process training as the coordinator: accepts num_workers workers, then in every round
+// receives a parameter delta from each, and sends back the mean delta of the workers still training
+void RunCoordinator() {
+  struct sync_hello hello, first;
+  struct sync_header h;
+  struct sockaddr_in addr;
+  long long a, n = 0, max_n, active, all_done, round, tail_round = 0, bytes = 0;
+  int listen_fd, fd, w, one = 1, *fds = (int *)malloc(num_workers * sizeof(int));
+  char *finished = (char *)calloc(num_workers, 1), *done = (char *)calloc(num_workers, 1);
+  real *sum, *buf, scale;
+  double begin;
+  memset(&first, 0, sizeof(first));
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(sync_port);
+  if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, num_workers) != 0) {
+    printf("ERROR: cannot listen on port %d\n", sync_port);
+    exit(1);
+  }
+  for (w = 0; w < num_workers; w++) fds[w] = -1;
+  printf("Coordinator waiting for %d workers on port %d\n", num_workers, sync_port);
+  for (a = 0; a < num_workers; a++) {
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd == -1) {
+      printf("ERROR: accepting a worker failed\n");
+      exit(1);
+    }
+    RecvAll(fd, &hello, sizeof(hello));
+    if (memcmp(hello.magic, "W2VMSYN", 8) || hello.version != SYNC_VERSION || hello.num_workers != num_workers ||
+        hello.worker_id < 0 || hello.worker_id >= num_workers || fds[hello.worker_id] != -1) {
+      printf("ERROR: unexpected worker %lld of %lld\n", hello.worker_id, hello.num_workers);
+      exit(1);
+    }
+    if (a == 0) first = hello;
+    else if (hello.vocab_size != first.vocab_size || hello.lemmas_size != first.lemmas_size || hello.layer1_w_size != first.layer1_w_size ||
+        hello.layer1_l_size != first.layer1_l_size || hello.negative != first.negative || hello.sync_rows != first.sync_rows) {
+      printf("ERROR: worker %lld has a different vocabulary or model settings than worker %lld\n", hello.worker_id, first.worker_id);
+      exit(1);
+    }
+    fds[hello.worker_id] = fd;
+    if (debug_mode > 0) printf("Worker %lld connected\n", hello.worker_id);
+  }
+  close(listen_fd);
+  max_n = first.vocab_size * first.layer1_w_size + first.lemmas_size * first.layer1_l_size;
+  if (first.negative > 0) max_n += first.vocab_size * (first.layer1_w_size + first.layer1_l_size);
+  sum = (real *)malloc(max_n * sizeof(real));
+  buf = (real *)malloc(max_n * sizeof(real));
+  if (sum == NULL || buf == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  begin = GetTime();
+  for (round = 0; ; round++) {
+    active = 0;
+    all_done = 1;
+    for (w = 0; w < num_workers; w++) {
+      RecvAll(fds[w], &h, sizeof(h));
+      if (h.round != round || h.n > max_n || (w > 0 && h.n != n)) {
+        printf("ERROR: worker %d is out of step in round %lld\n", w, round);
+        exit(1);
+      }
+      n = h.n;
+      RecvAll(fds[w], w == 0 ? sum : buf, n * sizeof(real));
+      if (w > 0) for (a = 0; a < n; a++) sum[a] += buf[a];
+      if (!finished[w]) active++;
+      done[w] = h.done;
+      if (!h.done) all_done = 0;
+    }
+    // Workers that finished before this round send no new updates; once all have, the round
+    // averages the rows that were never exchanged over every worker
+    scale = 1.0 / (active > 0 ? active : num_workers);
+    for (a = 0; a < n; a++) sum[a] *= scale;
+    for (w = 0; w < num_workers; w++) {
+      SendAll(fds[w], &all_done, sizeof(long long));
+      SendAll(fds[w], sum, n * sizeof(real));
+      finished[w] = done[w];
+    }
+    bytes += 2 * num_workers * n * sizeof(real);
+    if (debug_mode > 1) printf("Round %lld: %lld of %d workers training, %.1f MB per worker each way\n",
+      round, active, num_workers, n * sizeof(real) / 1048576.0);
+    if (all_done && (first.sync_rows == 0 || tail_round)) break;
+    if (all_done) tail_round = 1;
+  }
+  for (w = 0; w < num_workers; w++) close(fds[w]);
+  if (debug_mode > 0) printf("Coordinated %lld rounds in %.2fs, %.1f MB transferred\n", round + 1, GetTime() - begin, bytes / 1048576.0);
+}
+
+// Connects to the coordinator given by -connect, retrying while it is not up yet
+void ConnectCoordinator() {
+  struct addrinfo hints, *res;
+  struct sync_hello hello;
+  char host[MAX_STRING], *port;
+  double deadline = GetTime() + SYNC_CONNECT_SECONDS;
+  strcpy(host, sync_connect);
+  port = strrchr(host, ':');
+  if (port == NULL) {
+    printf("ERROR: -connect expects host:port\n");
+    exit(1);
+  }
+  *port++ = 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res) != 0) {
+    printf("ERROR: cannot resolve coordinator %s\n", sync_connect);
+    exit(1);
+  }
+  while (1) {
+    sync_fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    if (sync_fd != -1 && connect(sync_fd, res->ai_addr, res->ai_addrlen) == 0) break;
+    if (sync_fd != -1) close(sync_fd);
+    if (GetTime() > deadline) {
+      printf("ERROR: cannot connect to coordinator %s\n", sync_connect);
+      exit(1);
+    }
+    usleep(200000);
+  }
+  freeaddrinfo(res);
+  memset(&hello, 0, sizeof(hello));
+  memcpy(hello.magic, "W2VMSYN", 8);
+  hello.version = SYNC_VERSION;
+  hello.worker_id = worker_id;
+  hello.num_workers = num_workers;
+  hello.vocab_size = vocab_size;
+  hello.lemmas_size = lemmas_size;
+  hello.layer1_w_size = layer1_w_size;
+  hello.layer1_l_size = layer1_l_size;
+  hello.negative = negative;
+  hello.sync_rows = sync_rows;
+  SendAll(sync_fd, &hello, sizeof(hello));
+}
+
+// Keeps a copy of the parameters as of the last exchange; all workers start from the same
+// parameters, as initialization only depends on the position of each element
+void InitSync() {
+  long long w, l, n;
+  SyncLength(1, &w, &l, &n);
+  sync_syn0_w = AllocMatrix(vocab_size, layer1_w_size, "syn0_w.sync");
+  sync_syn0_l = AllocMatrix(lemmas_size, layer1_l_size, "syn0_l.sync");
+  memcpy(sync_syn0_w, syn0_w, w * sizeof(real));
+  memcpy(sync_syn0_l, syn0_l, l * sizeof(real));
+  if (negative > 0) {
+    sync_syn1neg = AllocMatrix(vocab_size, layer1_size, "syn1neg.sync");
+    memcpy(sync_syn1neg, syn1neg, n * sizeof(real));
+  }
+  if (debug_mode > 0) {
+    printf("Worker %d of %d: exchanging %.1f MB every %lld words", worker_id, num_workers,
+      SyncLength(0, &w, &l, &n) * sizeof(real) / 1048576.0, sync_every);
+    printf(", at most %lld rounds ahead of the last exchange\n", staleness);
+  }
+}
+
+// Moves the difference between the parameters and their last exchanged state into buf, or
+// applies the mean delta in buf while keeping updates made since the delta was taken
+void SyncSegment(real *m, real *last, real *buf, long long n, real *mean) {
+  long long a;
+  real delta;
+  if (mean == NULL) {
+    for (a = 0; a < n; a++) buf[a] = m[a] - last[a];
+    return;
+  }
+  for (a = 0; a < n; a++) {
+    delta = mean[a] - buf[a];
+    m[a] += delta;
+    last[a] += mean[a];
+  }
+}
+
+// Exchanges parameter deltas with the coordinator every sync_every words of this worker. After
+// the training threads finish it keeps taking part in rounds until every worker has finished
+void *SyncThread(void *unused) {
+  struct sync_header h;
+  long long w, l, n, total, all_done, tail_round = 0;
+  real *delta, *mean;
+  double begin, waited = 0, sent = 0;
+  SyncLength(1, &w, &l, &n);
+  delta = (real *)malloc((w + l + n) * sizeof(real));
+  mean = (real *)malloc((w + l + n) * sizeof(real));
+  while (1) {
+    while (threads_finished < num_threads && word_count_actual < (sync_rounds + 1) * sync_every) usleep(1000);
+    h.round = sync_rounds;
+    h.done = threads_finished == num_threads;
+    total = SyncLength(tail_round, &w, &l, &n);
+    h.n = total;
+    SyncSegment(syn0_w, sync_syn0_w, delta, w, NULL);
+    SyncSegment(syn0_l, sync_syn0_l, delta + w, l, NULL);
+    if (n > 0) SyncSegment(syn1neg, sync_syn1neg, delta + w + l, n, NULL);
+    begin = GetTime();
+    TraceEvent(trace_sync, "round", begin, -1, h.round);
+    SendAll(sync_fd, &h, sizeof(h));
+    SendAll(sync_fd, delta, total * sizeof(real));
+    RecvAll(sync_fd, &all_done, sizeof(long long));
+    RecvAll(sync_fd, mean, total * sizeof(real));
+    waited += GetTime() - begin;
+    sent += total * sizeof(real);
+    TraceSpan(trace_sync, "exchange", begin);
+    SyncSegment(syn0_w, sync_syn0_w, delta, w, mean);
+    SyncSegment(syn0_l, sync_syn0_l, delta + w, l, mean + w);
+    if (n > 0) SyncSegment(syn1neg, sync_syn1neg, delta + w + l, n, mean + w + l);
+    sync_rounds++;
+    if (debug_mode > 2) printf("\nSync round %lld: %.1f MB each way in %.2fs\n", h.round, total * sizeof(real) / 1048576.0, GetTime() - begin);
+    if (all_done && (sync_rows == 0 || tail_round)) break;
+    if (all_done) tail_round = 1;
+  }
+  close(sync_fd);
+  if (debug_mode > 0) printf("\nSynchronized %lld rounds: %.1f MB sent and received, %.2fs in exchanges\n",
+    sync_rounds, sent / 1048576.0, waited);
+  free(delta);
+  free(mean);
+  pthread_exit(NULL);
+}
+
+void CheckpointWrite(struct checkpoint_writer *w, void *data, long long bytes) {
+  long long n, done = 0;
+  while (bytes > 0 && !w->failed) {
+    n = CHECKPOINT_BUFFER - w->used;
+    if (n > bytes) n = bytes;
+    memcpy(w->buf + w->used, (char *)data + done, n);
+    w->used += n;
+    done += n;
+    bytes -= n;
+    if (w->used < CHECKPOINT_BUFFER) break;
+    // Buffer full: hand it to the kernel
+    for (n = 0; n < w->used && !w->failed; ) {
+      long long written = write(w->fd, w->buf + n, w->used - n);
+      if (written <= 0) w->failed = 1; else n += written;
+    }
+    w->used = 0;
+  }
+}
+
+void CheckpointFlush(struct checkpoint_writer *w) {
+  long long n, written;
+  for (n = 0; n < w->used && !w->failed; ) {
+    written = write(w->fd, w->buf + n, w->used - n);
+    if (written <= 0) w->failed = 1; else n += written;
+  }
+  w->used = 0;
+}
+
+// Writes a replicated matrix, averaging the replicas on the fly
+void CheckpointWriteMatrix(struct checkpoint_writer *w, real **replica, long long n) {
+  long long e, r;
+  real mean;
+  if (num_replicas == 1) {
+    CheckpointWrite(w, replica[0], n * sizeof(real));
+    return;
+  }
+  for (e = 0; e < n; e++) {
+    mean = 0;
+    for (r = 0; r < num_replicas; r++) mean += replica[r][e];
+    mean /= num_replicas;
+    CheckpointWrite(w, &mean, sizeof(real));
+  }
+}
+
+// Saves the training state to checkpoint_file through a temporary file; avoids stdio and malloc,
+// so it can run in a child forked from the multithreaded trainer. Returns 0 on success
+int SaveCheckpoint() {
+  struct checkpoint_header h;
+  struct checkpoint_writer w;
+  struct lemma_count *cursor;
+  char tmp_file[MAX_STRING + 16];
+  long long a;
+  int n, lemma;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, "W2VMCKP", 8);
+  h.version = CHECKPOINT_VERSION;
+  h.num_threads = num_threads;
+  h.vocab_size = vocab_size;
+  h.lemmas_size = lemmas_size;
+  h.layer1_w_size = layer1_w_size;
+  h.layer1_l_size = layer1_l_size;
+  h.negative = negative;
+  h.iter = iter;
+  h.train_words = train_words;
+  // Progress as of the recorded thread positions, not the live counters
+  h.word_count_actual = 0;
+  for (a = 0; a < num_threads; a++) h.word_count_actual += thread_states[a].recorded_words;
+  h.alpha = alpha;
+  h.starting_alpha = starting_alpha;
+  strcpy(tmp_file, checkpoint_file);
+  strcat(tmp_file, ".tmp");
+  w.fd = open(tmp_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  w.failed = (w.fd == -1);
+  w.used = 0;
+  w.buf = checkpoint_buffer;
+  CheckpointWrite(&w, &h, sizeof(h));
+  CheckpointWrite(&w, thread_states, num_threads * sizeof(struct thread_state));
+  CheckpointWriteMatrix(&w, replica_syn0_w, (long long)vocab_size * layer1_w_size);
+  CheckpointWriteMatrix(&w, replica_syn0_l, (long long)lemmas_size * layer1_l_size);
+  if (negative > 0) CheckpointWriteMatrix(&w, replica_syn1neg, (long long)vocab_size * layer1_size);
+  for (a = 0; a < vocab_size; a++) {
+    n = 0;
+    if (word_lemma_counts[a].lemma != -1) for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) n++;
+    CheckpointWrite(&w, &n, sizeof(int));
+    if (n > 0) for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) {
+      lemma = cursor->lemma;
+      CheckpointWrite(&w, &lemma, sizeof(int));
+      CheckpointWrite(&w, &cursor->cn, sizeof(long long));
+    }
+  }
+  CheckpointFlush(&w);
+  if (w.fd != -1 && fsync(w.fd) != 0) w.failed = 1;
+  if (w.fd != -1) close(w.fd);
+  if (w.failed || rename(tmp_file, checkpoint_file) != 0) return 1;
+  return 0;
+}
+
+// Restores parameters, progress, learning rate and thread positions saved by SaveCheckpoint()
+void LoadCheckpoint() {
+  struct checkpoint_header h;
+  struct lemma_count *cursor;
+  long long a, b, cn;
+  int n, lemma;
+  FILE *fin = fopen(checkpoint_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: checkpoint %s not found\n", checkpoint_file);
+    exit(1);
+  }
+  if (fread(&h, sizeof(h), 1, fin) != 1 || memcmp(h.magic, "W2VMCKP", 8) || h.version != CHECKPOINT_VERSION) {
+    printf("ERROR: %s is not a checkpoint of this version\n", checkpoint_file);
+    exit(1);
+  }
+  if (h.vocab_size != vocab_size || h.lemmas_size != lemmas_size || h.layer1_w_size != layer1_w_size ||
+      h.layer1_l_size != layer1_l_size || h.negative != negative || h.num_threads != num_threads) {
+    printf("ERROR: checkpoint %s was saved with a different vocabulary, vector sizes, -negative or -threads\n", checkpoint_file);
+    exit(1);
+  }
+  if (h.iter != iter) printf("WARNING: checkpoint %s was saved with -iter %lld\n", checkpoint_file, h.iter);
+  if (fread(thread_states, sizeof(struct thread_state), num_threads, fin) != num_threads ||
+      fread(syn0_w, sizeof(real), (long long)vocab_size * layer1_w_size, fin) != (long long)vocab_size * layer1_w_size ||
+      fread(syn0_l, sizeof(real), (long long)lemmas_size * layer1_l_size, fin) != (long long)lemmas_size * layer1_l_size ||
+      (negative > 0 && fread(syn1neg, sizeof(real), (long long)vocab_size * layer1_size, fin) != (long long)vocab_size * layer1_size)) {
+    printf("ERROR: checkpoint %s is truncated\n", checkpoint_file);
+    exit(1);
+  }
+  for (a = 0; a < num_threads; a++) {
+    thread_states[a].epoch = 0;
+    thread_states[a].words = thread_states[a].recorded_words;
+  }
+  for (a = 0; a < vocab_size; a++) {
+    if (fread(&n, sizeof(int), 1, fin) != 1) {
+      printf("ERROR: checkpoint %s is truncated\n", checkpoint_file);
+      exit(1);
+    }
+    // Word-lemma counts only change during training when they did not come with the vocabulary
+    for (b = 0; b < n; b++) {
+      if (fread(&lemma, sizeof(int), 1, fin) != 1 || fread(&cn, sizeof(long long), 1, fin) != 1) {
+        printf("ERROR: checkpoint %s is truncated\n", checkpoint_file);
+        exit(1);
+      }
+      if (!count_lemmas_in_training) continue;
+      if (b == 0) {
+        word_lemma_counts[a].lemma = lemma;
+        word_lemma_counts[a].cn = cn;
+        word_lemma_counts[a].next = NULL;
+      } else {
+        cursor = CreateNode(lemma, word_lemma_counts[a].next);
+        cursor->cn = cn;
+        word_lemma_counts[a].next = cursor;
+      }
+    }
+  }
+  fclose(fin);
+  word_count_actual = h.word_count_actual;
+  alpha = h.alpha;
+  starting_alpha = h.starting_alpha;
+  resume = 1;
+  if (debug_mode > 0) printf("Resuming from checkpoint %s at %.2f%% of training\n", checkpoint_file,
+    word_count_actual / (real)(iter * train_words + 1) * 100);
+}
+
+// Loads the parameters of the run that -continue extends into the leading rows of the matrices;
+// rows of words and lemmas added by ExtendVocabFromTrainFile() keep their fresh initialization
+void LoadPreviousModel() {
+  struct checkpoint_header h;
+  FILE *fin = fopen(continue_file, "rb");
+  if (fin == NULL) {
+    printf("ERROR: checkpoint %s not found\n", continue_file);
+    exit(1);
+  }
+  if (fread(&h, sizeof(h), 1, fin) != 1 || memcmp(h.magic, "W2VMCKP", 8) || h.version != CHECKPOINT_VERSION) {
+    printf("ERROR: %s is not a checkpoint of this version\n", continue_file);
+    exit(1);
+  }
+  if (h.vocab_size != old_vocab_size || h.lemmas_size != old_lemmas_size) {
+    printf("ERROR: checkpoint %s does not belong to the vocabulary cache %s\n", continue_file, vocab_cache_file);
+    exit(1);
+  }
+  if (h.layer1_w_size != layer1_w_size || h.layer1_l_size != layer1_l_size || h.negative != negative) {
+    printf("ERROR: checkpoint %s was saved with different vector sizes or -negative\n", continue_file);
+    exit(1);
+  }
+  fseek(fin, h.num_threads * sizeof(struct thread_state), SEEK_CUR);
+  if (fread(syn0_w, sizeof(real), h.vocab_size * layer1_w_size, fin) != h.vocab_size * layer1_w_size ||
+      fread(syn0_l, sizeof(real), h.lemmas_size * layer1_l_size, fin) != h.lemmas_size * layer1_l_size ||
+      (negative > 0 && fread(syn1neg, sizeof(real), h.vocab_size * layer1_size, fin) != h.vocab_size * layer1_size)) {
+    printf("ERROR: checkpoint %s is truncated\n", continue_file);
+    exit(1);
+  }
+  fclose(fin);
+  if (debug_mode > 0) printf("Continuing the model of %s\n", continue_file);
+}
+
+// Returns 1 once every running training thread has recorded its state for the given checkpoint
+int ThreadStatesRecorded(int epoch) {
+  long long a;
+  for (a = 0; a < num_threads; a++) if (!thread_states[a].done && thread_states[a].epoch != epoch) return 0;
+  return 1;
+}
+
+// Resident set size of the process in bytes
+long long ResidentBytes() {
+  long long pages = 0, resident = 0;
+  FILE *fin = fopen("/proc/self/statm", "r");
+  if (fin == NULL) return 0;
+  if (fscanf(fin, "%lld %lld", &pages, &resident) != 2) resident = 0;
+  fclose(fin);
+  return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Writes the current training metrics as JSON to stats_file, replacing it atomically so that
+// readers never see a partial file. Rates and the loss are over the time since the last write
+void WriteStats(const char *phase) {
+  static double last_time = 0, last_loss = 0;
+  static long long last_words = 0, last_samples = 0, *last_thread_words = NULL;
+  char tmp_file[MAX_STRING + 4];
+  long long a, dropped = 0;
+  double now = GetTime(), read_time = 0, elapsed, busy;
+  FILE *fo;
+  if (stats_file[0] == 0) return;
+  for (a = 0; a < num_threads && thread_states != NULL; a++) {
+    dropped += thread_states[a].dropped;
+    read_time += thread_states[a].read_time;
+  }
+  // Once training has ended, rates refer to the training phase only
+  elapsed = phase_time[PHASE_TRAINING] > 0 ? phase_time[PHASE_TRAINING] : (training_start > 0 ? now - training_start : 0);
+  if (last_time == 0) last_time = training_start;
+  busy = elapsed * num_threads;
+  sprintf(tmp_file, "%s.tmp", stats_file);
+  fo = fopen(tmp_file, "wb");
+  if (fo == NULL) return;
+  fprintf(fo, "{\n  \"phase\": \"%s\",\n  \"seconds\": %.3f,\n", phase, now - program_start);
+  fprintf(fo, "  \"threads\": %d,\n  \"epoch\": %lld,\n  \"iter\": %lld,\n", num_threads,
+    train_words > 0 ? word_count_actual / train_words + (word_count_actual < iter * train_words) : 0, iter);
+  fprintf(fo, "  \"progress\": %.6f,\n  \"alpha\": %.8f,\n", word_count_actual / (double)(iter * train_words + 1), alpha);
+  fprintf(fo, "  \"words\": %lld,\n", word_count_actual);
+  fprintf(fo, "  \"words_per_sec\": %.1f,\n", elapsed > 0 ? word_count_actual / elapsed : 0);
+  fprintf(fo, "  \"recent_words_per_sec\": %.1f,\n", now > last_time ? (word_count_actual - last_words) / (now - last_time) : 0);
+  // Per thread, so that a slow or stalled thread shows up
+  if (thread_states != NULL && last_thread_words == NULL) last_thread_words = (long long *)calloc(num_threads, sizeof(long long));
+  fprintf(fo, "  \"words_per_sec_per_thread\": [");
+  for (a = 0; a < num_threads && thread_states != NULL; a++)
+    fprintf(fo, "%s%.1f", a ? ", " : "", elapsed > 0 ? thread_states[a].words / elapsed : 0);
+  fprintf(fo, "],\n  \"recent_words_per_sec_per_thread\": [");
+  for (a = 0; a < num_threads && thread_states != NULL; a++) {
+    fprintf(fo, "%s%.1f", a ? ", " : "", now > last_time ? (thread_states[a].words - last_thread_words[a]) / (now - last_time) : 0);
+    last_thread_words[a] = thread_states[a].words;
+  }
+  fprintf(fo, "],\n");
+  if (loss_samples > last_samples) fprintf(fo, "  \"sampled_loss\": %.6f,\n", (loss_sum - last_loss) / (loss_samples - last_samples));
+  else fprintf(fo, "  \"sampled_loss\": null,\n");
+  fprintf(fo, "  \"subsampling_drop_rate\": %.6f,\n", word_count_actual > 0 ? dropped / (double)word_count_actual : 0);
+  fprintf(fo, "  \"read_seconds\": %.3f,\n  \"compute_seconds\": %.3f,\n", read_time, busy > read_time ? busy - read_time : 0);
+  fprintf(fo, "  \"rss_bytes\": %lld,\n", ResidentBytes());
+  fprintf(fo, "  \"bytes\": {\"syn0_w\": %lld, \"syn0_l\": %lld, \"syn1\": %lld, \"syn1neg\": %lld, \"table\": %lld},\n",
+    vocab_size * layer1_w_size * (long long)sizeof(real), lemmas_size * layer1_l_size * (long long)sizeof(real),
+    hs ? vocab_size * layer1_size * (long long)sizeof(real) : 0, negative > 0 ? vocab_size * layer1_size * (long long)sizeof(real) : 0,
+    negative > 0 ? table_size * (long long)sizeof(int) : 0);
+  fprintf(fo, "  \"phase_seconds\": {");
+  for (a = 0; a < NUM_PHASES; a++) fprintf(fo, "%s\"%s\": %.3f", a ? ", " : "", phase_names[a], phase_time[a]);
+  fprintf(fo, "}\n}\n");
+  if (fclose(fo) != 0 || rename(tmp_file, stats_file) != 0) printf("\nWARNING: cannot write stats file %s\n", stats_file);
+  last_time = now;
+  last_words = word_count_actual;
+  last_loss = loss_sum;
+  last_samples = loss_samples;
+}
+
+// Sums the word counts and sampled losses of the training threads
+void SumProgress() {
+  long long a, sum = 0, samples = 0;
+  double loss = 0;
+  for (a = 0; a < num_threads; a++) {
+    sum += thread_states[a].words;
+    loss += thread_states[a].loss;
+    samples += thread_states[a].loss_samples;
+  }
+  word_count_actual = sum;
+  loss_sum = loss;
+  loss_samples = samples;
+}
+
+// Learning rate after the words the training threads have published so far. Each trainer calls this
+// at its own 10k-word boundaries, so the rate follows the words trained rather than the timing of the
+// monitor, and single-thread runs are repeatable. -deterministic sets the rate per round instead
+real ThreadAlpha() {
+  long long a, words = 0;
+  real rate;
+  if (alpha_schedule != ALPHA_LINEAR || deterministic) return alpha;
+  for (a = 0; a < num_threads; a++) words += thread_states[a].words;
+  rate = starting_alpha * (1 - words / (real)(iter * train_words + 1));
+  return rate < starting_alpha * 0.0001 ? starting_alpha * 0.0001 : rate;
+}
+
+// Adds the negative sampling log-loss of one output to the thread's sampled loss
+void AddSampledLoss(struct thread_state *state, real f, long long label) {
+  if (f > MAX_EXP) f = MAX_EXP;
+  if (f < -MAX_EXP) f = -MAX_EXP;
+  state->loss += log(1 + exp(label ? -f : f));
+  state->loss_samples++;
+}
+
+// Reports the sampled loss of each epoch once the total progress passes its end, and asks the
+// training threads to stop when the relative improvement over the previous epoch is too small
+void CheckEpochs(long long *epoch, double *epoch_loss, long long *epoch_samples, double *last_loss) {
+  double loss;
+  while (train_words > 0 && word_count_actual >= (*epoch + 1) * train_words && *epoch < iter) {
+    if (loss_samples > *epoch_samples) {
+      loss = (loss_sum - *epoch_loss) / (loss_samples - *epoch_samples);
+      if (debug_mode > 0) printf("\nEpoch %lld: sampled loss %.4f\n", *epoch + 1, loss);
+      if (early_stop > 0 && *last_loss > 0 && (*last_loss - loss) / *last_loss < early_stop && *epoch + 1 < iter) {
+        if (debug_mode > 0) printf("Stopping early: the loss improved by %.2f%%\n", (*last_loss - loss) / *last_loss * 100);
+        stop_training = 1;
+      }
+      *last_loss = loss;
+    }
+    *epoch_loss = loss_sum;
+    *epoch_samples = loss_samples;
+    (*epoch)++;
+  }
+}
+
+// Runs on the main thread while training. It is the only writer of word_count_actual and alpha:
+// it sums the per-thread counters, publishes the learning rate and prints wall-clock throughput.
+// Every checkpoint_every minutes it also asks the training threads to record their positions at
+// their next sentence boundary, where they wait until it has forked a child that writes the
+// copy-on-write snapshot of the model while training goes on
+void MonitorTraining() {
+  double now, next = GetTime() + checkpoint_every * 60, begin = 0, next_stats = GetTime() + stats_every;
+  double epoch_loss, last_loss = 0, interval_loss = 0;
+  long long ticks = 0, first_words, epoch, epoch_samples, interval_samples = 0;
+  pid_t child = 0;
+  int status;
+  if (checkpoint_every > 0) checkpoint_buffer = (char *)malloc(CHECKPOINT_BUFFER);
+  SumProgress();
+  first_words = word_count_actual;
+  epoch = train_words > 0 ? word_count_actual / train_words : 0;
+  epoch_loss = loss_sum;
+  epoch_samples = loss_samples;
+  while (threads_finished < num_threads) {
+    usleep(MONITOR_USEC);
+    SumProgress();
+    if (alpha_schedule == ALPHA_LINEAR && !deterministic) {
+      alpha = starting_alpha * (1 - word_count_actual / (real)(iter * train_words + 1));
+      if (alpha < starting_alpha * 0.0001) alpha = starting_alpha * 0.0001;
+    }
+    now = GetTime();
+    if (debug_mode > 1 && ++ticks % PROGRESS_TICKS == 0) {
+      printf("%cAlpha: %f  Progress: %.2f%%  Words/sec: %.2fk (%.2fk per thread)  ", 13, alpha,
+        word_count_actual / (real)(iter * train_words + 1) * 100,
+        (word_count_actual - first_words) / (now - training_start) / 1000,
+        (word_count_actual - first_words) / (now - training_start) / 1000 / num_threads);
+      if (loss_samples > interval_samples) printf("Loss: %.4f  ", (loss_sum - interval_loss) / (loss_samples - interval_samples));
+      interval_loss = loss_sum;
+      interval_samples = loss_samples;
+      fflush(stdout);
+    }
+    CheckEpochs(&epoch, &epoch_loss, &epoch_samples, &last_loss);
+    if (now >= next_stats) {
+      WriteStats("training");
+      next_stats = now + stats_every;
+    }
+    if (checkpoint_every <= 0) continue;
+    if (child > 0 && waitpid(child, &status, WNOHANG) == child) {
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("\nWARNING: writing checkpoint %s failed\n", checkpoint_file);
+      else if (debug_mode > 0) printf("\nSaved checkpoint %s in %.2fs\n", checkpoint_file, now - begin);
+      child = 0;
+    }
+    if (child > 0 || now < next) continue;
+    checkpoint_epoch++;
+    while (!ThreadStatesRecorded(checkpoint_epoch)) usleep(1000);
+    begin = GetTime();
+    child = fork();
+    TraceSpan(trace_main, "checkpoint fork", begin);
+    if (child == 0) _exit(SaveCheckpoint());
+    checkpoint_forked = checkpoint_epoch;
+    if (child == -1) {
+      printf("\nWARNING: cannot fork to write checkpoint %s\n", checkpoint_file);
+      child = 0;
+    }
+    next = GetTime() + checkpoint_every * 60;
+  }
+  SumProgress();
+  CheckEpochs(&epoch, &epoch_loss, &epoch_samples, &last_loss);
+  if (child > 0) {
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("\nWARNING: writing checkpoint %s failed\n", checkpoint_file);
+  }
+  if (debug_mode > 0) printf("\nTrained %lld words in %.2fs: %.2fk words/sec\n", word_count_actual - first_words,
+    GetTime() - training_start, (word_count_actual - first_words) / (GetTime() - training_start) / 1000);
+}
+
+// Precomputes the subsampling keep thresholds, so the training threads only compare integers
+void InitSubsampling() {
+  long long a;
+  double ran, threshold = 0;
+  // Frequencies are taken over all counted words, which for continued training includes earlier data
+  for (a = 0; a < vocab_size; a++) threshold += vocab_cn[a];
+  threshold *= sample;
+  vocab_keep = (unsigned short *)malloc(vocab_size * sizeof(unsigned short));
+  for (a = 0; a < vocab_size; a++) {
+    // Keep probability of the word, scaled to the 16 random bits drawn per token
+    ran = ((sqrt(vocab_cn[a] / threshold) + 1) * threshold / vocab_cn[a]) * 65536;
+    vocab_keep[a] = ran >= 65535 ? 65535 : (unsigned short)ran;
+  }
+}
+
+// Opens cycles, instructions, LLC misses and dTLB read misses of the calling thread as one group,
+// so they are always scheduled together; events the CPU does not offer are left out.
+// Returns the group leader, or -1 if not even cycles can be counted
+int OpenPerfCounters() {
+  struct perf_event_attr attr;
+  unsigned long long configs[PERF_COUNTERS] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+  int a, fd, leader = -1;
+  for (a = 0; a < PERF_COUNTERS; a++) {
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = a == 3 ? PERF_TYPE_HW_CACHE : PERF_TYPE_HARDWARE;
+    attr.config = configs[a];
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+    if (a == 0 && fd == -1) return -1;
+    if (a == 0) leader = fd;
+    perf_available[a] = fd != -1;
+  }
+  return leader;
+}
+
+// Reads the counters of a group into values, in PERF_COUNTERS order
+void ReadPerfCounters(int leader, unsigned long long *values) {
+  unsigned long long buf[PERF_COUNTERS + 1];
+  int a, b = 1;
+  if (read(leader, buf, sizeof(buf)) <= 0) return;
+  for (a = 0; a < PERF_COUNTERS; a++) values[a] = perf_available[a] ? buf[b++] : 0;
+}
+
+// Adds the counts since the last reading to one part of the loop
+void AccountPerfCounters(int leader, unsigned long long *last, unsigned long long *part) {
+  unsigned long long now[PERF_COUNTERS];
+  int a;
+  ReadPerfCounters(leader, now);
+  for (a = 0; a < PERF_COUNTERS; a++) {
+    part[a] += now[a] - last[a];
+    last[a] = now[a];
+  }
+}
+
+void PrintPerfLine(const char *label, unsigned long long *c, long long words) {
+  int a;
+  printf("%-14s", label);
+  for (a = 0; a < PERF_COUNTERS; a++) if (perf_available[a]) printf(" %s %.3g", perf_names[a], (double)c[a]);
+  if (c[0] > 0) printf("  IPC %.2f", c[1] / (double)c[0]);
+  if (perf_available[2] && c[1] > 0) printf("  LLC MPKI %.2f", c[2] * 1000.0 / c[1]);
+  if (perf_available[3] && c[1] > 0) printf("  dTLB MPKI %.2f", c[3] * 1000.0 / c[1]);
+  if (words > 0) printf("  cycles/word %.0f", c[0] / (double)words);
+  printf("\n");
+}
+
+// Prints the counters of the reader and SGD parts of the training loop per epoch and in total.
+// High LLC or dTLB misses per thousand instructions at a low IPC point to memory latency or
+// bandwidth, a high IPC to compute
+void PrintPerfCounters() {
+  unsigned long long total[2][PERF_COUNTERS], *e;
+  char label[32];
+  long long epoch, part, a;
+  memset(total, 0, sizeof(total));
+  printf("Hardware counters of the training threads (user space):\n");
+  for (epoch = 0; epoch < iter; epoch++) for (part = 0; part < 2; part++) {
+    e = &perf_epochs[(epoch * 2 + part) * PERF_COUNTERS];
+    if (e[0] == 0) continue;
+    sprintf(label, "epoch %lld %s", epoch + 1, part == PERF_READER ? "read" : "sgd");
+    PrintPerfLine(label, e, 0);
+    for (a = 0; a < PERF_COUNTERS; a++) total[part][a] += e[a];
+  }
+  PrintPerfLine("total read", total[PERF_READER], word_count_actual);
+  PrintPerfLine("total sgd", total[PERF_SGD], word_count_actual);
+}
+
+// Where a training thread starts reading; the workers of a multi-process run split the file
+// between all of their threads
+long long ThreadStart(long long id) {
+  return file_size / ((long long)num_threads * num_workers) * (id + (long long)worker_id * num_threads);
+}
+
+// Moves a training thread to its shard. With -deterministic the shard starts at the next line,
+// so every sentence is read whole by exactly one thread
+void SeekThreadStart(FILE *fi, long long id) {
+  int ch;
+  fseek(fi, ThreadStart(id), SEEK_SET);
+  if (!deterministic || ThreadStart(id) == 0) return;
+  do ch = fgetc_unlocked(fi); while (ch != '\n' && ch != EOF);
+}
+
+void *TrainModelThread(void *id) {
+  long long a, b, d, cw, word, lemma, last_word, last_lemma, sentence_length = 0, sentence_position = 0;
+  long long word_count = 0, last_word_count = 0, sen_w[MAX_SENTENCE_LENGTH + 1], sen_l[MAX_SENTENCE_LENGTH + 1];
+  long long l1_w, l1_l, l2, c, target, label, local_iter = iter, dropped = 0, sentences = 0, finished_epoch, round = 0;
+  double read_begin = 0, read_end, sgd_begin = 0, stall_begin;
+  int traced = 0, perf_fd = -1;
+  unsigned long long perf_last[PERF_COUNTERS], perf_parts[2][PERF_COUNTERS], *perf_epoch;
+  unsigned long long next_random = RandomStream((long long)id + (long long)worker_id * num_threads);
+  char eof = 0;
+  real f, g, alpha = ThreadAlpha();     // Shadows the shared learning rate, which only the monitor writes
+  // The parameters this thread trains, shadowing the shared ones when replicas are used
+  real *syn0_w = replica_syn0_w[(long long)id % num_replicas];
+  real *syn0_l = replica_syn0_l[(long long)id % num_replicas];
+  real *syn1neg = replica_syn1neg[(long long)id % num_replicas];
+  struct thread_state *state = &thread_states[(long long)id];
+  int epoch, track_loss;
+  if (pin_threads) PinThread((long long)id);
+  real *neu1 = (real *)calloc(layer1_size, sizeof(real));
+  real *neu1e = (real *)calloc(layer1_size, sizeof(real));
+  FILE *fi = fopen(train_file, "rb");
+  if (perf_counters) {
+    perf_fd = OpenPerfCounters();
+    memset(perf_parts, 0, sizeof(perf_parts));
+    if (perf_fd != -1) {
+      ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+      ReadPerfCounters(perf_fd, perf_last);
+    }
+  }
+  if (resume) {
+    // Continue where this thread stood when the checkpoint was taken
+    local_iter = state->done ? 0 : state->local_iter;
+    word_count = state->word_count;
+    last_word_count = state->last_word_count;
+    next_random = state->next_random;
+    fseek(fi, state->file_pos, SEEK_SET);
+  } else SeekThreadStart(fi, (long long)id);
+  while (local_iter > 0) {
+    if (word_count - last_word_count > 10000) {
+      // Progress is summed by MonitorTraining(); this thread only publishes its own count
+      state->words += word_count - last_word_count;
+      state->dropped += dropped;
+      dropped = 0;
+      last_word_count = word_count;
+      alpha = ThreadAlpha();
+      // Wait for the coordinator rather than run more than staleness rounds ahead of the last exchange
+      if (sync_fd != -1 && word_count_actual >= (sync_rounds + 1 + staleness) * sync_every) {
+        stall_begin = GetTime();
+        while (word_count_actual >= (sync_rounds + 1 + staleness) * sync_every) usleep(1000);
+        TraceSpan((long long)id, "stall: sync", stall_begin);
+      }
+    }
+    if (sentence_length == 0) {
+      if (deterministic && word_count >= (round + 1) * round_words && round + 1 < rounds_per_epoch) {
+        FinishRound((long long)id);
+        round++;
+        alpha = ThreadAlpha();
+      }
+      // Record the position of this thread if a checkpoint has been requested since the last sentence
+      epoch = checkpoint_epoch;
+      if (state->epoch != epoch) {
+        state->file_pos = ftell(fi);
+        state->word_count = word_count;
+        state->last_word_count = last_word_count;
+        state->local_iter = local_iter;
+        state->next_random = next_random;
+        state->recorded_words = state->words;
+        __sync_synchronize();
+        state->epoch = epoch;
+        // Train nothing past the recorded position until the snapshot has been forked, or resuming would
+        // train the sentences in between twice. -deterministic threads cannot wait here, as the others may
+        // be held in a round barrier before they record
+        if (!deterministic) {
+          stall_begin = GetTime();
+          while (checkpoint_forked != epoch) usleep(100);
+          TraceSpan((long long)id, "stall: checkpoint", stall_begin);
+        }
+      }
+      if (traced) TraceSpan((long long)id, "sgd", sgd_begin);
+      if (perf_fd != -1) AccountPerfCounters(perf_fd, perf_last, perf_parts[PERF_SGD]);
+      traced = tracing && sentences++ % TRACE_SAMPLE == 0;
+      if (stats_file[0] != 0 || traced) read_begin = GetTime();
+      while (1) {
+        long long indices[2];
+        indices[0] = -1;
+        indices[1] = -1;
+        ReadWordLemmaIndices(fi, &eof, indices);
+        word = indices[0];
+        lemma = indices[1];
+        if (eof) break;
+        if (word == -1) continue;
+
+        word_count++;
+
+        if (lemma == -1) continue;
+
+        // Word-lemma counts come with the vocabulary unless it was read from text files
+        if (count_lemmas_in_training) {
+          if (word_lemma_counts[word].lemma == -1) {
+            word_lemma_counts[word].lemma = lemma;
+            word_lemma_counts[word].cn = 1;
+          } else {
+            FindAndIncrementNode(&(word_lemma_counts[word]), lemma);
+          }
+        }
+
+        if (word == 0) break;
+        // The subsampling randomly discards frequent words while keeping the ranking same
+        if (sample > 0) {
+          next_random = next_random * (unsigned long long)25214903917 + 11;
+          if ((next_random & 0xFFFF) > vocab_keep[word]) {
+            dropped++;
+            continue;
+          }
+        }
+
+        sen_w[sentence_length] = word;
+        sen_l[sentence_length] = lemma;
+        sentence_length++;
+        if (sentence_length >= MAX_SENTENCE_LENGTH) break;
+      }
+      if (stats_file[0] != 0 || traced) {
+        read_end = GetTime();
+        state->read_time += read_end - read_begin;
+        if (traced) TraceEvent((long long)id, "read", read_begin, read_end, sentence_length);
+        sgd_begin = read_end;
+      }
+      if (perf_fd != -1) AccountPerfCounters(perf_fd, perf_last, perf_parts[PERF_READER]);
+      sentence_position = 0;
+    }
+    if (eof || (word_count > train_words / num_threads) || stop_training) {
+      // Threads at the end of their shard take part in the rounds the others still have to finish
+      if (deterministic) {
+        for (; round < rounds_per_epoch; round++) FinishRound((long long)id);
+        alpha = ThreadAlpha();
+      }
+      round = 0;
+      state->words += word_count - last_word_count;
+      state->dropped += dropped;
+      dropped = 0;
+      finished_epoch = iter - local_iter;
+      local_iter--;
+      if (stop_training) local_iter = 0;
+      if (tracing) TraceEvent((long long)id, "epoch end", GetTime(), -1, finished_epoch + 1);
+      if (perf_fd != -1 && finished_epoch >= 0 && finished_epoch < iter) {
+        // Add this thread's counts of the epoch to the totals of all threads
+        AccountPerfCounters(perf_fd, perf_last, perf_parts[PERF_SGD]);
+        perf_epoch = &perf_epochs[finished_epoch * 2 * PERF_COUNTERS];
+        for (a = 0; a < 2 * PERF_COUNTERS; a++) __sync_fetch_and_add(&perf_epoch[a], perf_parts[a / PERF_COUNTERS][a % PERF_COUNTERS]);
+        memset(perf_parts, 0, sizeof(perf_parts));
+      }
+      if (local_iter == 0) {
+        state->local_iter = 0;
+        state->recorded_words = state->words;
+        state->done = 1;
+        break;
+      }
+      word_count = 0;
       last_word_count = 0;
       sentence_length = 0;
-      fseek(fi, file_size / (long long)num_threads * (long long)id, SEEK_SET);
-      eof = 0;
+      SeekThreadStart(fi, (long long)id);
+      eof = 0;
+      continue;
+    }
+    word = sen_w[sentence_position];
+    lemma = sen_l[sentence_position];
+    if (word == -1 || lemma == -1) continue;
+    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
+    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    b = next_random % window;
+    track_loss = ((next_random >> 24) % LOSS_SAMPLE) == 0;
+    if (cbow) {  //train the cbow architecture
+      fprintf(stderr, "%s", "CBOW is not implented yet\n");
+      exit(-1);
+      // in -> hidden
+      cw = 0;
+      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+        c = sentence_position - window + a; // c is index in sentence of target word
+        if (c < 0) continue;
+        if (c >= sentence_length) continue;
+        last_word = sen_w[c];
+        last_lemma = sen_l[c];
+        if (last_word == -1 || last_lemma) continue;
+        // Add up the elements of the input vector for a word
+        for (c = 0; c < layer1_w_size; c++) neu1[c] += syn0_w[c + last_word * layer1_w_size];
+        for (c = 0; c < layer1_l_size; c++) neu1[layer1_w_size + c] += syn0_l[c + last_lemma * layer1_l_size];
+        cw++;
+      }
+      if (cw) {
+        for (c = 0; c < layer1_size; c++) neu1[c] /= cw;
+        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
+          f = 0;
+          l2 = vocab[word].point[d] * layer1_size;
+          // Propagate hidden -> output
+          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1[c + l2];
+          if (f <= -MAX_EXP) continue;
+          else if (f >= MAX_EXP) continue;
+          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+          // 'g' is the gradient multiplied by the learning rate
+          g = (1 - vocab[word].code[d] - f) * alpha;
+          // Propagate errors output -> hidden
+          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
+          // Learn weights hidden -> output
+          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * neu1[c];
+        }
+        // NEGATIVE SAMPLING
+        if (negative > 0) for (d = 0; d < negative + 1; d++) {
+          if (d == 0) {
+            target = word;
+            label = 1;
+          } else {
+            next_random = next_random * (unsigned long long)25214903917 + 11;
+            target = SampleNegative(next_random);
+            if (target == 0) target = next_random % (vocab_size - 1) + 1;
+            if (target == word) continue;
+            label = 0;
+          }
+          l2 = target * layer1_size;
+          f = 0;
+          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1neg[c + l2];
+          if (track_loss) AddSampledLoss(state, f, label);
+          if (f > MAX_EXP) g = (label - 1) * alpha;
+          else if (f < -MAX_EXP) g = (label - 0) * alpha;
+          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
+          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * neu1[c];
+        }
+        // hidden -> in
+        for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+          c = sentence_position - window + a;
+          if (c < 0) continue;
+          if (c >= sentence_length) continue;
+          last_word = sen_w[c];
+          last_lemma = sen_l[c];
+          if (last_word == -1 || last_lemma == -1) continue; // not sure if I want to check both
+          for (c = 0; c < layer1_w_size; c++) syn0_w[c + last_word * layer1_w_size] += neu1e[c];
+          for (c = 0; c < layer1_l_size; c++) syn0_l[c + last_lemma * layer1_l_size] += neu1e[layer1_w_size + c];
+        }
+      }
+    } else {  //train skip-gram
+      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
+        c = sentence_position - window + a;
+        if (c < 0) continue;
+        if (c >= sentence_length) continue;
+        last_word = sen_w[c];
+        last_lemma = sen_l[c];
+        if (last_word == -1 || last_lemma == -1) continue; // not sure if I want to check bot
+        l1_w = last_word * layer1_w_size;
+        l1_l = last_lemma * layer1_l_size;
+        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
+        // HIERARCHICAL SOFTMAX
+        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
+          fprintf(stderr, "%s", "Hierarchical Softmax is not implented yet\n");
+          exit(-1);
+          f = 0;
+          l2 = vocab[word].point[d] * layer1_size;
+          // Propagate hidden -> output
+          for (c = 0; c < layer1_w_size; c++) f += syn0_w[c + l1_w] * syn1[c + l2];
+          for (c = 0; c < layer1_l_size; c++) f += syn0_l[c + l1_l] * syn1[layer1_w_size + c + l2];
+          if (f <= -MAX_EXP) continue;
+          else if (f >= MAX_EXP) continue;
+          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
+          // 'g' is the gradient multiplied by the learning rate
+          g = (1 - vocab[word].code[d] - f) * alpha;
+          // Propagate errors output -> hidden
+          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
+          // Learn weights hidden -> output
+          for (c = 0; c < layer1_w_size; c++) syn1[c + l2] += g * syn0_w[c + l1_w];
+          for (c = 0; c < layer1_l_size; c++) syn1[layer1_w_size + c + l2] += g * syn0_l[c + l1_l];
+        }
+        // NEGATIVE SAMPLING
+        if (negative > 0) for (d = 0; d < negative + 1; d++) {
+          if (d == 0) {
+            target = word;
+            label = 1;
+          } else {
+            next_random = next_random * (unsigned long long)25214903917 + 11;
+            target = SampleNegative(next_random);
+            if (target == 0) target = next_random % (vocab_size - 1) + 1;
+            if (target == word) continue;
+            label = 0;
+          }
+          l2 = target * layer1_size;
+          f = 0; // dot product
+          for (c = 0; c < layer1_w_size; c++) f += syn0_w[c + l1_w] * syn1neg[c + l2];
+          for (c = 0; c < layer1_l_size; c++) f += syn0_l[c + l1_l] * syn1neg[layer1_w_size + c + l2];
+          if (track_loss) AddSampledLoss(state, f, label);
+          if (f > MAX_EXP) g = (label - 1) * alpha;
+          else if (f < -MAX_EXP) g = (label - 0) * alpha;
+          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
+          for (c = 0; c < layer1_w_size; c++) syn1neg[c + l2] += g * syn0_w[c + l1_w];
+          for (c = 0; c < layer1_l_size; c++) syn1neg[layer1_w_size + c + l2] += g * syn0_l[c + l1_l];
+        }
+        // Learn weights input -> hidden
+        for (c = 0; c < layer1_w_size; c++) syn0_w[c + l1_w] += neu1e[c];
+        for (c = 0; c < layer1_l_size; c++) syn0_l[c + l1_l] += neu1e[layer1_w_size + c];
+      }
+    }
+    sentence_position++;
+    if (sentence_position >= sentence_length) {
+      sentence_length = 0;
       continue;
     }
-    word = sen_w[sentence_position];
-    lemma = sen_l[sentence_position];
-    if (word == -1 || lemma == -1) continue;
-    for (c = 0; c < layer1_size; c++) neu1[c] = 0;
-    for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-    next_random = next_random * (unsigned long long)25214903917 + 11;
-    b = next_random % window;
-    if (cbow) {  //train the cbow architecture
-      fprintf(stderr, "%s", "CBOW is not implented yet\n");
-      exit(-1);
-      // in -> hidden
-      cw = 0;
-      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-        c = sentence_position - window + a; // c is index in sentence of target word
-        if (c < 0) continue;
-        if (c >= sentence_length) continue;
-        last_word = sen_w[c];
-        last_lemma = sen_l[c];
-        if (last_word == -1 || last_lemma) continue;
-        // Add up the elements of the input vector for a word
-        for (c = 0; c < layer1_w_size; c++) neu1[c] += syn0_w[c + last_word * layer1_w_size];
-        for (c = 0; c < layer1_l_size; c++) neu1[layer1_w_size + c] += syn0_l[c + last_lemma * layer1_l_size];
-        cw++;
-      }
-      if (cw) {
-        for (c = 0; c < layer1_size; c++) neu1[c] /= cw;
-        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
-          f = 0;
-          l2 = vocab[word].point[d] * layer1_size;
-          // Propagate hidden -> output
-          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1[c + l2];
-          if (f <= -MAX_EXP) continue;
-          else if (f >= MAX_EXP) continue;
-          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-          // 'g' is the gradient multiplied by the learning rate
-          g = (1 - vocab[word].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_size; c++) syn1[c + l2] += g * neu1[c];
-        }
-        // NEGATIVE SAMPLING
-        if (negative > 0) for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = word;
-            label = 1;
-          } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
-            if (target == word) continue;
-            label = 0;
-          }
-          l2 = target * layer1_size;
-          f = 0;
-          for (c = 0; c < layer1_size; c++) f += neu1[c] * syn1neg[c + l2];
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_size; c++) syn1neg[c + l2] += g * neu1[c];
-        }
-        // hidden -> in
-        for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-          c = sentence_position - window + a;
-          if (c < 0) continue;
-          if (c >= sentence_length) continue;
-          last_word = sen_w[c];
-          last_lemma = sen_l[c];
-          if (last_word == -1 || last_lemma == -1) continue; // not sure if I want to check both
-          for (c = 0; c < layer1_w_size; c++) syn0_w[c + last_word * layer1_w_size] += neu1e[c];
-          for (c = 0; c < layer1_l_size; c++) syn0_l[c + last_lemma * layer1_l_size] += neu1e[layer1_w_size + c];
+  }
+  state->done = 1;
+  if (perf_fd != -1) close(perf_fd);
+  __sync_fetch_and_add(&threads_finished, 1);
+  fclose(fi);
+  free(neu1);
+  free(neu1e);
+  pthread_exit(NULL);
+}
+
+struct export_buffer {
+  char *data;
+  long long used, size;
+};
+
+FILE *export_fo, *export_fo_num;
+long long export_rows, export_next_block, export_turn;
+int export_lemmas;
+pthread_mutex_t export_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t export_cond = PTHREAD_COND_INITIALIZER;
+
+void ReserveExport(struct export_buffer *buf, long long bytes) {
+  if (buf->used + bytes <= buf->size) return;
+  buf->size = (buf->used + bytes) * 2;
+  buf->data = (char *)realloc(buf->data, buf->size);
+  if (buf->data == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+}
+
+// Writes the shortest decimal form that reads back as the same float; %g drops trailing
+// zeros, so starting at 6 digits also covers every shorter form
+static inline int FormatReal(char *s, real f) {
+  int precision, len;
+  for (precision = 6; precision < 9; precision++) {
+    len = sprintf(s, "%.*g", precision, f);
+    if (strtof(s, NULL) == f) return len;
+  }
+  return sprintf(s, "%.9g", f);
+}
+
+void ExportVector(struct export_buffer *out, real *vec, long long size) {
+  long long b;
+  if (binary) {
+    memcpy(out->data + out->used, vec, size * sizeof(real));
+    out->used += size * sizeof(real);
+  } else for (b = 0; b < size; b++) {
+    out->used += FormatReal(out->data + out->used, vec[b]);
+    out->data[out->used++] = ' ';
+  }
+}
+
+// Averages the lemma vectors of word a weighted by how often it was seen with each; returns the number of lemmas
+long long LemmaAverage(long long a, real *lemma_average) {
+  struct lemma_count *cursor;
+  long long b, num_lemmas = 0;
+  double avg_denom = 0;
+  for (b = 0; b < layer1_l_size; b++) lemma_average[b] = 0;
+  for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) {
+    num_lemmas++;
+    if (cursor->lemma == -1) continue;
+    for (b = 0; b < layer1_l_size; b++) lemma_average[b] += cursor->cn * syn0_l[cursor->lemma * layer1_l_size + b];
+    avg_denom += cursor->cn;
+  }
+  if (avg_denom != 0) for (b = 0; b < layer1_l_size; b++) lemma_average[b] /= avg_denom;
+  return num_lemmas;
+}
+
+// -reduce-word-size and -reduce-lemma-size project the saved vectors onto their principal components.
+// Word vectors and lemma vectors get a projection each, so the saved rows keep the word / lemma split;
+// the lemma averages use the lemma projection, which commutes with averaging as the weights sum to one.
+// Words without lemmas keep an all-zero lemma part
+struct reduce_job {
+  real *x, *mean, *proj;
+  long long rows, cols, k;
+  double *partial;                      // Per thread: column sums, then the cols x cols Gram matrix
+} reduce_word, reduce_lemma, *reduce_current;
+long long export_w_size, export_l_size, export_size;   // Sizes of the saved vectors
+
+// Accumulates column sums and the Gram matrix of a share of the rows. Each block of rows is transposed
+// first so that every entry of the Gram block is a contiguous dot product
+void *GramThread(void *id) {
+  struct reduce_job *job = reduce_current;
+  long long t = (long long)id, cols = job->cols, first = job->rows * t / num_threads, last = job->rows * (t + 1) / num_threads;
+  long long a, r, i, j, rows;
+  double *sums = &job->partial[t * (cols + cols * cols)], *gram = sums + cols;
+  real *block = (real *)malloc(cols * REDUCE_BLOCK * sizeof(real)), dot;
+  memset(sums, 0, (cols + cols * cols) * sizeof(double));
+  for (a = first; a < last; a += REDUCE_BLOCK) {
+    rows = last - a < REDUCE_BLOCK ? last - a : REDUCE_BLOCK;
+    for (r = 0; r < rows; r++) for (i = 0; i < cols; i++) block[i * REDUCE_BLOCK + r] = job->x[(a + r) * cols + i];
+    for (i = 0; i < cols; i++) {
+      for (r = 0; r < rows; r++) sums[i] += block[i * REDUCE_BLOCK + r];
+      for (j = i; j < cols; j++) {
+        dot = 0;
+        for (r = 0; r < rows; r++) dot += block[i * REDUCE_BLOCK + r] * block[j * REDUCE_BLOCK + r];
+        gram[i * cols + j] += dot;
+      }
+    }
+  }
+  free(block);
+  pthread_exit(NULL);
+}
+
+// Orthonormalizes the l columns of the d x l matrix y (modified Gram-Schmidt)
+void Orthonormalize(double *y, long long d, long long l) {
+  long long i, j, m;
+  double dot, norm;
+  for (j = 0; j < l; j++) {
+    for (m = 0; m < j; m++) {
+      dot = 0;
+      for (i = 0; i < d; i++) dot += y[i * l + j] * y[i * l + m];
+      for (i = 0; i < d; i++) y[i * l + j] -= dot * y[i * l + m];
+    }
+    norm = 0;
+    for (i = 0; i < d; i++) norm += y[i * l + j] * y[i * l + j];
+    norm = sqrt(norm);
+    for (i = 0; i < d; i++) y[i * l + j] = norm > 0 ? y[i * l + j] / norm : 0;
+  }
+}
+
+// Eigenvalues (left on the diagonal of a) and eigenvectors (columns of v) of the symmetric n x n a,
+// with cyclic Jacobi rotations
+void JacobiEigen(double *a, double *v, long long n) {
+  long long p, q, k, sweep;
+  double off, theta, t, c, s, x, y;
+  for (p = 0; p < n; p++) for (q = 0; q < n; q++) v[p * n + q] = p == q;
+  for (sweep = 0; sweep < 100; sweep++) {
+    off = 0;
+    for (p = 0; p < n; p++) for (q = p + 1; q < n; q++) off += a[p * n + q] * a[p * n + q];
+    if (off < 1e-30) break;
+    for (p = 0; p < n; p++) for (q = p + 1; q < n; q++) {
+      if (fabs(a[p * n + q]) < 1e-300) continue;
+      theta = (a[q * n + q] - a[p * n + p]) / (2 * a[p * n + q]);
+      t = (theta >= 0 ? 1 : -1) / (fabs(theta) + sqrt(theta * theta + 1));
+      c = 1 / sqrt(t * t + 1);
+      s = t * c;
+      for (k = 0; k < n; k++) {
+        x = a[k * n + p];
+        y = a[k * n + q];
+        a[k * n + p] = c * x - s * y;
+        a[k * n + q] = s * x + c * y;
+      }
+      for (k = 0; k < n; k++) {
+        x = a[p * n + k];
+        y = a[q * n + k];
+        a[p * n + k] = c * x - s * y;
+        a[q * n + k] = s * x + c * y;
+      }
+      for (k = 0; k < n; k++) {
+        x = v[k * n + p];
+        y = v[k * n + q];
+        v[k * n + p] = c * x - s * y;
+        v[k * n + q] = s * x + c * y;
+      }
+    }
+  }
+}
+
+// Finds the top job->k principal components of job->x. The covariance comes from one multithreaded pass
+// over the rows; its leading subspace is then found with a randomized range finder and power iterations,
+// and the small projected matrix is diagonalized exactly. The sizes here are at most a few thousand,
+// so this costs one pass over the matrix plus O(cols^2 * k) work
+void ComputeReduction(struct reduce_job *job, const char *name) {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long a, i, j, m, iter, cols = job->cols, l = job->k + REDUCE_OVERSAMPLE, *order;
+  double *cov = (double *)calloc(cols * cols, sizeof(double)), *mean = (double *)calloc(cols, sizeof(double));
+  double *q, *y, *b, *u, u1, u2, trace = 0, kept = 0, begin = GetTime();
+  unsigned long long next_random = 1;
+  if (l > cols) l = cols;
+  job->partial = (double *)malloc(num_threads * (cols + cols * cols) * sizeof(double));
+  reduce_current = job;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, GramThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  for (a = 0; a < num_threads; a++) {
+    for (i = 0; i < cols; i++) mean[i] += job->partial[a * (cols + cols * cols) + i];
+    for (i = 0; i < cols * cols; i++) cov[i] += job->partial[a * (cols + cols * cols) + cols + i];
+  }
+  for (i = 0; i < cols; i++) mean[i] /= job->rows;
+  for (i = 0; i < cols; i++) for (j = i; j < cols; j++) {
+    cov[i * cols + j] = cov[i * cols + j] / job->rows - mean[i] * mean[j];
+    cov[j * cols + i] = cov[i * cols + j];
+  }
+  for (i = 0; i < cols; i++) trace += cov[i * cols + i];
+  // Gaussian start, then q = orth(cov^iter * omega)
+  q = (double *)malloc(cols * l * sizeof(double));
+  y = (double *)malloc(cols * l * sizeof(double));
+  for (i = 0; i < cols * l; i++) {
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    u1 = ((next_random >> 11) + 1.0) / 9007199254740993.0;
+    next_random = next_random * (unsigned long long)25214903917 + 11;
+    u2 = (next_random >> 11) / 9007199254740992.0;
+    q[i] = sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+  }
+  for (iter = 0; iter <= REDUCE_POWER_ITER; iter++) {
+    for (i = 0; i < cols; i++) for (j = 0; j < l; j++) {
+      y[i * l + j] = 0;
+      for (m = 0; m < cols; m++) y[i * l + j] += cov[i * cols + m] * q[m * l + j];
+    }
+    Orthonormalize(y, cols, l);
+    memcpy(q, y, cols * l * sizeof(double));
+  }
+  // b = q' cov q is l x l; its eigenvectors rotate q onto the principal directions
+  b = (double *)calloc(l * l, sizeof(double));
+  u = (double *)malloc(l * l * sizeof(double));
+  for (i = 0; i < cols; i++) for (j = 0; j < l; j++) {
+    y[i * l + j] = 0;
+    for (m = 0; m < cols; m++) y[i * l + j] += cov[i * cols + m] * q[m * l + j];
+  }
+  for (i = 0; i < l; i++) for (j = 0; j < l; j++) for (m = 0; m < cols; m++) b[i * l + j] += q[m * l + i] * y[m * l + j];
+  JacobiEigen(b, u, l);
+  order = (long long *)malloc(l * sizeof(long long));
+  for (i = 0; i < l; i++) order[i] = i;
+  for (i = 0; i < l; i++) for (j = i + 1; j < l; j++) if (b[order[j] * l + order[j]] > b[order[i] * l + order[i]]) {
+    m = order[i];
+    order[i] = order[j];
+    order[j] = m;
+  }
+  job->mean = (real *)malloc(cols * sizeof(real));
+  job->proj = (real *)malloc(cols * job->k * sizeof(real));
+  for (i = 0; i < cols; i++) job->mean[i] = mean[i];
+  for (i = 0; i < cols; i++) for (j = 0; j < job->k; j++) {
+    u1 = 0;
+    for (m = 0; m < l; m++) u1 += q[i * l + m] * u[m * l + order[j]];
+    job->proj[i * job->k + j] = u1;
+  }
+  for (j = 0; j < job->k; j++) kept += b[order[j] * l + order[j]];
+  if (debug_mode > 0) printf("Reduced %s vectors from %lld to %lld dimensions keeping %.1f%% of the variance in %.2fs\n",
+    name, cols, job->k, trace > 0 ? kept * 100 / trace : 0, GetTime() - begin);
+  free(job->partial);
+  free(cov);
+  free(mean);
+  free(q);
+  free(y);
+  free(b);
+  free(u);
+  free(order);
+  free(pt);
+}
+
+// out = (in - mean) * proj
+void ProjectRow(struct reduce_job *job, real *in, real *out) {
+  long long i, j;
+  for (j = 0; j < job->k; j++) out[j] = 0;
+  for (i = 0; i < job->cols; i++) for (j = 0; j < job->k; j++) out[j] += (in[i] - job->mean[i]) * job->proj[i * job->k + j];
+}
+
+// Fills row with the saved form of word a, before any -normalize: its word vector and lemma average,
+// projected if reducing. row needs room for 2 * layer1_size values. Returns the number of lemmas
+long long WordRow(long long a, real *row) {
+  struct lemma_count *cursor;
+  real *raw = row + layer1_size;
+  long long num_lemmas;
+  if (reduce_word.k == 0 && reduce_lemma.k == 0) {
+    memcpy(row, &syn0_w[a * layer1_w_size], layer1_w_size * sizeof(real));
+    return LemmaAverage(a, row + layer1_w_size);
+  }
+  memcpy(raw, &syn0_w[a * layer1_w_size], layer1_w_size * sizeof(real));
+  num_lemmas = LemmaAverage(a, raw + layer1_w_size);
+  if (reduce_word.k > 0) ProjectRow(&reduce_word, raw, row);
+  else memcpy(row, raw, layer1_w_size * sizeof(real));
+  for (cursor = &word_lemma_counts[a]; cursor != NULL && (cursor->lemma == -1 || cursor->cn == 0); cursor = cursor->next);
+  if (cursor == NULL) memset(row + export_w_size, 0, export_l_size * sizeof(real));
+  else if (reduce_lemma.k > 0) ProjectRow(&reduce_lemma, raw + layer1_w_size, row + export_w_size);
+  else memcpy(row + export_w_size, raw + layer1_w_size, layer1_l_size * sizeof(real));
+  return num_lemmas;
+}
+
+// Sets up the projections of -reduce-word-size and -reduce-lemma-size and the sizes of the saved vectors
+void InitReduction() {
+  export_w_size = layer1_w_size;
+  export_l_size = layer1_l_size;
+  if (reduce_w_size > 0 && reduce_w_size < layer1_w_size) {
+    reduce_word.x = syn0_w;
+    reduce_word.rows = vocab_size;
+    reduce_word.cols = layer1_w_size;
+    reduce_word.k = export_w_size = reduce_w_size;
+    ComputeReduction(&reduce_word, "word");
+  }
+  if (reduce_l_size > 0 && reduce_l_size < layer1_l_size) {
+    reduce_lemma.x = syn0_l;
+    reduce_lemma.rows = lemmas_size;
+    reduce_lemma.cols = layer1_l_size;
+    reduce_lemma.k = export_l_size = reduce_l_size;
+    ComputeReduction(&reduce_lemma, "lemma");
+  }
+  export_size = export_w_size + export_l_size;
+}
+
+// Per-dimension mean and sum of squared deviations of the exported word rows over a range of words
+struct column_stats {
+  double *mean, *m2;
+  long long n;
+};
+
+struct column_stats *column_stats;
+real *column_mean, *column_scale, *npy_words;
+
+void *ColumnStatsThread(void *id) {
+  struct column_stats *st = &column_stats[(long long)id];
+  real *row = (real *)malloc(2 * layer1_size * sizeof(real));
+  long long a, b, first = vocab_size * (long long)id / num_threads, last = vocab_size * ((long long)id + 1) / num_threads;
+  double delta;
+  st->mean = (double *)calloc(export_size, sizeof(double));
+  st->m2 = (double *)calloc(export_size, sizeof(double));
+  st->n = 0;
+  for (a = first; a < last; a++) {
+    WordRow(a, row);
+    st->n++;
+    for (b = 0; b < export_size; b++) {
+      delta = row[b] - st->mean[b];
+      st->mean[b] += delta / st->n;
+      st->m2[b] += delta * (row[b] - st->mean[b]);
+    }
+  }
+  free(row);
+  pthread_exit(NULL);
+}
+
+// Computes the column statistics with Welford's method on every thread and merges the partial
+// results, which keeps the variance accurate without a second pass over the rows
+void ComputeColumnStats() {
+  long long a, b, n = 0;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  double *mean = (double *)calloc(export_size, sizeof(double)), *m2 = (double *)calloc(export_size, sizeof(double)), delta;
+  column_stats = (struct column_stats *)calloc(num_threads, sizeof(struct column_stats));
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, ColumnStatsThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  for (a = 0; a < num_threads; a++) {
+    if (column_stats[a].n == 0) continue;
+    for (b = 0; b < export_size; b++) {
+      delta = column_stats[a].mean[b] - mean[b];
+      mean[b] += delta * column_stats[a].n / (n + column_stats[a].n);
+      m2[b] += column_stats[a].m2[b] + delta * delta * n * column_stats[a].n / (n + column_stats[a].n);
+    }
+    n += column_stats[a].n;
+    free(column_stats[a].mean);
+    free(column_stats[a].m2);
+  }
+  column_mean = (real *)malloc(export_size * sizeof(real));
+  column_scale = (real *)malloc(export_size * sizeof(real));
+  for (b = 0; b < export_size; b++) {
+    column_mean[b] = mean[b];
+    // Constant columns are only centered
+    column_scale[b] = m2[b] > 0 ? 1 / sqrt(m2[b] / n) : 1;
+  }
+  free(column_stats);
+  free(mean);
+  free(m2);
+  free(pt);
+}
+
+// One output row: the word vector followed by the count-weighted average of its lemma vectors,
+// projected, standardized per column and scaled to unit length as the options ask
+void ExportWord(struct export_buffer *out, struct export_buffer *num, long long a, real *row) {
+  long long b, num_lemmas = WordRow(a, row), len = strlen(vocab[a].word);
+  double norm = 0;
+  if (normalize >= 1) for (b = 0; b < export_size; b++) row[b] = (row[b] - column_mean[b]) * column_scale[b];
+  if (normalize >= 2) {
+    for (b = 0; b < export_size; b++) norm += row[b] * row[b];
+    if (norm > 0) for (b = 0; b < export_size; b++) row[b] /= sqrt(norm);
+  }
+  if (npy_words != NULL) memcpy(&npy_words[a * export_size], row, export_size * sizeof(real));
+  memcpy(out->data + out->used, vocab[a].word, len);
+  out->used += len;
+  out->data[out->used++] = ' ';
+  ExportVector(out, row, export_size);
+  out->data[out->used++] = '\n';
+  ReserveExport(num, MAX_STRING + 24);
+  num->used += sprintf(num->data + num->used, "%s  %lld\n", vocab[a].word, num_lemmas);
+}
+
+void ExportLemma(struct export_buffer *out, long long a, real *row) {
+  long long len = strlen(lemmas[a].lemma);
+  memcpy(out->data + out->used, lemmas[a].lemma, len);
+  out->used += len;
+  out->data[out->used++] = ' ';
+  if (reduce_lemma.k > 0) {
+    ProjectRow(&reduce_lemma, &syn0_l[a * layer1_l_size], row);
+    ExportVector(out, row, export_l_size);
+  } else ExportVector(out, &syn0_l[a * layer1_l_size], layer1_l_size);
+  out->data[out->used++] = '\n';
+}
+
+// Export threads take blocks of rows in order, format them into a private buffer and write
+// each block in a single call once every earlier block is in the file
+void *ExportThread(void *id) {
+  struct export_buffer out = {NULL, 0, 0}, num = {NULL, 0, 0};
+  real *row = (real *)malloc(2 * layer1_size * sizeof(real));
+  long long a, block, last, row_bytes = MAX_STRING + 2 + 16 * layer1_size;
+  while (1) {
+    block = __sync_fetch_and_add(&export_next_block, 1);
+    if (block * EXPORT_BLOCK >= export_rows) break;
+    last = (block + 1) * EXPORT_BLOCK;
+    if (last > export_rows) last = export_rows;
+    out.used = num.used = 0;
+    for (a = block * EXPORT_BLOCK; a < last; a++) {
+      ReserveExport(&out, row_bytes);
+      if (export_lemmas) ExportLemma(&out, a, row); else ExportWord(&out, &num, a, row);
+    }
+    pthread_mutex_lock(&export_mutex);
+    while (export_turn != block) pthread_cond_wait(&export_cond, &export_mutex);
+    pthread_mutex_unlock(&export_mutex);
+    fwrite(out.data, 1, out.used, export_fo);
+    if (export_fo_num != NULL) fwrite(num.data, 1, num.used, export_fo_num);
+    pthread_mutex_lock(&export_mutex);
+    export_turn++;
+    pthread_cond_broadcast(&export_cond);
+    pthread_mutex_unlock(&export_mutex);
+  }
+  free(out.data);
+  free(num.data);
+  free(row);
+  pthread_exit(NULL);
+}
+
+// Writes rows word or lemma vectors with all training threads; fo_num gets the number of lemmas per word
+void ExportRows(FILE *fo, FILE *fo_num, long long rows, int lemmas) {
+  long long a;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  export_fo = fo;
+  export_fo_num = fo_num;
+  export_rows = rows;
+  export_lemmas = lemmas;
+  export_next_block = export_turn = 0;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, ExportThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+}
+
+char *model_base;
+
+// Quantizes a row to int8 with a scale of its own, so that row[b] is about q[b] * scale
+real QuantizeRow(real *row, long long size, signed char *q) {
+  long long b;
+  real max = 0;
+  for (b = 0; b < size; b++) if (fabs(row[b]) > max) max = fabs(row[b]);
+  if (max == 0) {
+    memset(q, 0, size);
+    return 0;
+  }
+  for (b = 0; b < size; b++) q[b] = (signed char)lrintf(row[b] * 127 / max);
+  return max / 127;
+}
+
+// Fills the lemma averages and the row norms of a share of the words in the model container
+void *ModelThread(void *id) {
+  struct model_file_header *h = (struct model_file_header *)model_base;
+  real *average = (real *)(model_base + h->average_vectors), *word_norms = (real *)(model_base + h->word_norms);
+  real *average_norms = (real *)(model_base + h->average_norms), *scales = (real *)(model_base + h->quant_scales);
+  signed char *quant_word = (signed char *)(model_base + h->quant_word), *quant_average = (signed char *)(model_base + h->quant_average);
+  long long a, b, first = vocab_size * (long long)id / num_threads, last = vocab_size * ((long long)id + 1) / num_threads;
+  double norm;
+  for (a = first; a < last; a++) {
+    LemmaAverage(a, &average[a * layer1_l_size]);
+    norm = 0;
+    for (b = 0; b < layer1_w_size; b++) norm += syn0_w[a * layer1_w_size + b] * syn0_w[a * layer1_w_size + b];
+    word_norms[a] = sqrt(norm);
+    norm = 0;
+    for (b = 0; b < layer1_l_size; b++) norm += average[a * layer1_l_size + b] * average[a * layer1_l_size + b];
+    average_norms[a] = sqrt(norm);
+    if (quantize) {
+      scales[a * 2] = QuantizeRow(&syn0_w[a * layer1_w_size], layer1_w_size, quant_word + a * layer1_w_size);
+      scales[a * 2 + 1] = QuantizeRow(&average[a * layer1_l_size], layer1_l_size, quant_average + a * layer1_l_size);
+    }
+  }
+  pthread_exit(NULL);
+}
+
+long long ModelSection(long long *pos, long long bytes) {
+  long long start = *pos;
+  *pos = (start + bytes + 63) & ~63LL;
+  return start;
+}
+
+// Writes words, lemmas and the word -> lemma weights into one file that readers can map and use
+// as is: aligned matrices, row norms, a string table and the weights in CSR form
+void SaveModelFile() {
+  struct model_file_header *h;
+  struct lemma_count *cursor;
+  pthread_t *pt;
+  long long a, len, pos = MODEL_FILE_HEADER, pairs = 0, string_bytes = 0, *names, *pair_start;
+  double begin = GetTime(), total;
+  int fd, err, *pair_lemma;
+  real *pair_weight;
+  for (a = 0; a < vocab_size; a++) {
+    string_bytes += strlen(vocab[a].word) + 1;
+    for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) if (cursor->lemma != -1) pairs++;
+  }
+  for (a = 0; a < lemmas_size; a++) string_bytes += strlen(lemmas[a].lemma) + 1;
+  fd = open(output_model_file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("ERROR: cannot create model file %s\n", output_model_file);
+    exit(1);
+  }
+  h = (struct model_file_header *)calloc(1, sizeof(struct model_file_header));
+  h->version = MODEL_FILE_VERSION;
+  h->words = vocab_size;
+  h->lemmas = lemmas_size;
+  h->word_size = layer1_w_size;
+  h->lemma_size = layer1_l_size;
+  h->pairs = pairs;
+  h->word_vectors = ModelSection(&pos, vocab_size * layer1_w_size * sizeof(real));
+  h->lemma_vectors = ModelSection(&pos, lemmas_size * layer1_l_size * sizeof(real));
+  h->average_vectors = ModelSection(&pos, vocab_size * layer1_l_size * sizeof(real));
+  h->word_norms = ModelSection(&pos, vocab_size * sizeof(real));
+  h->average_norms = ModelSection(&pos, vocab_size * sizeof(real));
+  h->word_names = ModelSection(&pos, (vocab_size + 1) * sizeof(long long));
+  h->lemma_names = ModelSection(&pos, (lemmas_size + 1) * sizeof(long long));
+  h->strings = ModelSection(&pos, string_bytes);
+  h->pair_start = ModelSection(&pos, (vocab_size + 1) * sizeof(long long));
+  h->pair_lemma = ModelSection(&pos, pairs * sizeof(int));
+  h->pair_weight = ModelSection(&pos, pairs * sizeof(real));
+  if (quantize) {
+    h->quant_word = ModelSection(&pos, vocab_size * layer1_w_size);
+    h->quant_average = ModelSection(&pos, vocab_size * layer1_l_size);
+    h->quant_scales = ModelSection(&pos, vocab_size * 2 * sizeof(real));
+  }
+  h->bytes = pos;
+  err = posix_fallocate(fd, 0, pos);
+  if (err != 0) {
+    printf("ERROR: cannot reserve %lld MB for model file %s: %s\n", pos >> 20, output_model_file, strerror(err));
+    exit(1);
+  }
+  model_base = (char *)mmap(NULL, pos, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (model_base == MAP_FAILED) {
+    printf("ERROR: cannot map model file %s\n", output_model_file);
+    exit(1);
+  }
+  memcpy(model_base, h, sizeof(struct model_file_header));
+  free(h);
+  h = (struct model_file_header *)model_base;
+  memcpy(model_base + h->word_vectors, syn0_w, vocab_size * layer1_w_size * sizeof(real));
+  memcpy(model_base + h->lemma_vectors, syn0_l, lemmas_size * layer1_l_size * sizeof(real));
+  pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, ModelThread, (void *)a);
+  // The string table and the weights are filled meanwhile
+  names = (long long *)(model_base + h->word_names);
+  for (a = 0, pos = 0; a < vocab_size; a++) {
+    len = strlen(vocab[a].word) + 1;
+    names[a] = pos;
+    memcpy(model_base + h->strings + pos, vocab[a].word, len);
+    pos += len;
+  }
+  names[vocab_size] = pos;
+  names = (long long *)(model_base + h->lemma_names);
+  for (a = 0; a < lemmas_size; a++) {
+    len = strlen(lemmas[a].lemma) + 1;
+    names[a] = pos;
+    memcpy(model_base + h->strings + pos, lemmas[a].lemma, len);
+    pos += len;
+  }
+  names[lemmas_size] = pos;
+  pair_start = (long long *)(model_base + h->pair_start);
+  pair_lemma = (int *)(model_base + h->pair_lemma);
+  pair_weight = (real *)(model_base + h->pair_weight);
+  for (a = 0, pos = 0; a < vocab_size; a++) {
+    pair_start[a] = pos;
+    total = 0;
+    for (cursor = &word_lemma_counts[a]; cursor != NULL; cursor = cursor->next) if (cursor->lemma != -1) {
+      pair_lemma[pos] = cursor->lemma;
+      pair_weight[pos++] = cursor->cn;
+      total += cursor->cn;
+    }
+    for (len = pair_start[a]; len < pos; len++) if (total > 0) pair_weight[len] /= total;
+  }
+  pair_start[vocab_size] = pos;
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  free(pt);
+  // Readers only accept the file once the magic is there, so it goes in after everything else
+  if (msync(model_base, h->bytes, MS_SYNC) != 0) printf("WARNING: writing model file %s failed\n", output_model_file);
+  memcpy(h->magic, "W2VMMOD", 8);
+  msync(model_base, MODEL_FILE_HEADER, MS_SYNC);
+  munmap(model_base, h->bytes);
+  if (debug_mode > 0) printf("Saved model file %s in %.2fs\n", output_model_file, GetTime() - begin);
+}
+
+// Creates a .npy file for a rows x cols array of descr, or a vector if cols is 0, and maps it. The
+// header is padded to 64 bytes so the data stays aligned for np.load(mmap_mode='r')
+char *MapNpyFile(char *file, const char *descr, long long item_size, long long rows, long long cols, long long *bytes) {
+  char header[256], *base;
+  int fd, err, len;
+  if (cols > 0) len = sprintf(header + 10, "{'descr': '%s', 'fortran_order': False, 'shape': (%lld, %lld), }", descr, rows, cols);
+  else len = sprintf(header + 10, "{'descr': '%s', 'fortran_order': False, 'shape': (%lld,), }", descr, rows);
+  while ((10 + len + 1) % 64 != 0) header[10 + len++] = ' ';
+  header[10 + len++] = '\n';
+  memcpy(header, "\x93NUMPY\x01\x00", 8);
+  header[8] = len & 0xFF;
+  header[9] = len >> 8;
+  *bytes = 10 + len + rows * (cols > 0 ? cols : 1) * item_size;
+  fd = open(file, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    printf("ERROR: cannot create %s\n", file);
+    exit(1);
+  }
+  err = posix_fallocate(fd, 0, *bytes);
+  if (err != 0) {
+    printf("ERROR: cannot reserve %lld MB for %s: %s\n", *bytes >> 20, file, strerror(err));
+    exit(1);
+  }
+  base = (char *)mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    printf("ERROR: cannot map %s\n", file);
+    exit(1);
+  }
+  memcpy(base, header, 10 + len);
+  return base;
+}
+
+void UnmapNpyFile(char *base, long long bytes, char *file) {
+  if (msync(base, bytes, MS_SYNC) != 0) printf("WARNING: writing %s failed\n", file);
+  munmap(base, bytes);
+}
+
+// Writes names as a fixed-width byte string array, which numpy maps as dtype S<width>
+void SaveNpyStrings(char *file, long long count, char *(*name)(long long)) {
+  char descr[32], *base;
+  long long a, width = 1, bytes;
+  for (a = 0; a < count; a++) if ((long long)strlen(name(a)) > width) width = strlen(name(a));
+  sprintf(descr, "|S%lld", width);
+  base = MapNpyFile(file, descr, width, count, 0, &bytes);
+  // Names shorter than the width are padded with zeros, which numpy strips
+  for (a = 0; a < count; a++) strncpy(base + bytes - count * width + a * width, name(a), width);
+  UnmapNpyFile(base, bytes, file);
+}
+
+char *VocabName(long long a) {
+  return vocab[a].word;
+}
+
+char *LemmaName(long long a) {
+  return lemmas[a].lemma;
+}
+
+char npy_words_file[MAX_STRING + 16];
+long long npy_words_bytes;
+
+// -output-npy: the exported word rows are copied into <prefix>.words.npy by the export threads
+void BeginNpyExport() {
+  char *base;
+  sprintf(npy_words_file, "%s.words.npy", output_npy_prefix);
+  base = MapNpyFile(npy_words_file, "<f4", sizeof(real), vocab_size, export_size, &npy_words_bytes);
+  npy_words = (real *)(base + npy_words_bytes - vocab_size * export_size * sizeof(real));
+}
+
+// Writes the lemma matrix, both vocabularies and a JSON index naming the files, relative to the index
+void FinishNpyExport() {
+  char file[MAX_STRING + 16], *base, *name = strrchr(output_npy_prefix, '/');
+  long long a, bytes;
+  real *lemma_rows;
+  FILE *fo;
+  name = name ? name + 1 : output_npy_prefix;
+  UnmapNpyFile((char *)npy_words + vocab_size * export_size * sizeof(real) - npy_words_bytes, npy_words_bytes, npy_words_file);
+  npy_words = NULL;
+  sprintf(file, "%s.lemmas.npy", output_npy_prefix);
+  base = MapNpyFile(file, "<f4", sizeof(real), lemmas_size, export_l_size, &bytes);
+  lemma_rows = (real *)(base + bytes - lemmas_size * export_l_size * sizeof(real));
+  if (reduce_lemma.k > 0) for (a = 0; a < lemmas_size; a++) ProjectRow(&reduce_lemma, &syn0_l[a * layer1_l_size], &lemma_rows[a * export_l_size]);
+  else memcpy(lemma_rows, syn0_l, lemmas_size * layer1_l_size * sizeof(real));
+  UnmapNpyFile(base, bytes, file);
+  sprintf(file, "%s.vocab.npy", output_npy_prefix);
+  SaveNpyStrings(file, vocab_size, VocabName);
+  sprintf(file, "%s.lemma_vocab.npy", output_npy_prefix);
+  SaveNpyStrings(file, lemmas_size, LemmaName);
+  sprintf(file, "%s.json", output_npy_prefix);
+  fo = fopen(file, "wb");
+  if (fo == NULL) {
+    printf("ERROR: cannot create %s\n", file);
+    exit(1);
+  }
+  fprintf(fo, "{\n  \"words\": %lld,\n  \"lemmas\": %lld,\n", vocab_size, lemmas_size);
+  fprintf(fo, "  \"size\": %lld,\n  \"word_size\": %lld,\n  \"lemma_size\": %lld,\n", export_size, export_w_size, export_l_size);
+  fprintf(fo, "  \"normalize\": %d,\n", normalize);
+  fprintf(fo, "  \"words_file\": \"%s.words.npy\",\n  \"lemmas_file\": \"%s.lemmas.npy\",\n", name, name);
+  fprintf(fo, "  \"vocab_file\": \"%s.vocab.npy\",\n  \"lemma_vocab_file\": \"%s.lemma_vocab.npy\"\n}\n", name, name);
+  fclose(fo);
+}
+
+real *kmeans_x, *kmeans_cent, *kmeans_sums;
+long long *kmeans_counts, *kmeans_changed, *kmeans_rows, kmeans_n;
+int *kmeans_cl;
+
+static inline real DotReal(real *x, real *y, long long size) {
+  long long b;
+  real sum = 0;
+  for (b = 0; b < size; b++) sum += x[b] * y[b];
+  return sum;
+}
+
+// Fills a share of the K-means rows: word vector and lemma average, scaled to unit length
+void *KMeansRowsThread(void *id) {
+  long long a, b, first = vocab_size * (long long)id / num_threads, last = vocab_size * ((long long)id + 1) / num_threads;
+  real *row, norm;
+  for (a = first; a < last; a++) {
+    row = &kmeans_x[a * layer1_size];
+    memcpy(row, &syn0_w[a * layer1_w_size], layer1_w_size * sizeof(real));
+    LemmaAverage(a, row + layer1_w_size);
+    norm = sqrt(DotReal(row, row, layer1_size));
+    if (norm > 0) for (b = 0; b < layer1_size; b++) row[b] /= norm;
+  }
+  pthread_exit(NULL);
+}
+
+// Assigns a share of the rows to their closest centroid and adds them to the thread's centroid sums.
+// Rows and centroids are compared in blocks so that a block of centroids is reused from cache by
+// KMEANS_ROW_BLOCK rows; the dot product itself is left to the vectorizer
+void *KMeansAssignThread(void *id) {
+  long long t = (long long)id, first = kmeans_n * t / num_threads, last = kmeans_n * (t + 1) / num_threads;
+  long long a, b, r, k, rows, row[KMEANS_ROW_BLOCK], best[KMEANS_ROW_BLOCK];
+  real *sums = &kmeans_sums[t * classes * layer1_size], dot, best_dot[KMEANS_ROW_BLOCK];
+  long long *counts = &kmeans_counts[t * classes];
+  memset(sums, 0, classes * layer1_size * sizeof(real));
+  memset(counts, 0, classes * sizeof(long long));
+  kmeans_changed[t] = 0;
+  for (a = first; a < last; a += KMEANS_ROW_BLOCK) {
+    rows = last - a < KMEANS_ROW_BLOCK ? last - a : KMEANS_ROW_BLOCK;
+    for (r = 0; r < rows; r++) {
+      row[r] = kmeans_rows != NULL ? kmeans_rows[a + r] : a + r;
+      best[r] = 0;
+      best_dot[r] = -2;
+    }
+    for (b = 0; b < classes; b += KMEANS_CENT_BLOCK) for (r = 0; r < rows; r++)
+      for (k = b; k < b + KMEANS_CENT_BLOCK && k < classes; k++) {
+        dot = DotReal(&kmeans_x[row[r] * layer1_size], &kmeans_cent[k * layer1_size], layer1_size);
+        if (dot > best_dot[r]) {
+          best_dot[r] = dot;
+          best[r] = k;
         }
       }
-    } else {  //train skip-gram
-      for (a = b; a < window * 2 + 1 - b; a++) if (a != window) {
-        c = sentence_position - window + a;
-        if (c < 0) continue;
-        if (c >= sentence_length) continue;
-        last_word = sen_w[c];
-        last_lemma = sen_l[c];
-        if (last_word == -1 || last_lemma == -1) continue; // not sure if I want to check bot
-        l1_w = last_word * layer1_w_size;
-        l1_l = last_lemma * layer1_l_size;
-        for (c = 0; c < layer1_size; c++) neu1e[c] = 0;
-        // HIERARCHICAL SOFTMAX
-        if (hs) for (d = 0; d < vocab[word].codelen; d++) {
-          fprintf(stderr, "%s", "Hierarchical Softmax is not implented yet\n");
-          exit(-1);
-          f = 0;
-          l2 = vocab[word].point[d] * layer1_size;
-          // Propagate hidden -> output
-          for (c = 0; c < layer1_w_size; c++) f += syn0_w[c + l1_w] * syn1[c + l2];
-          for (c = 0; c < layer1_l_size; c++) f += syn0_l[c + l1_l] * syn1[layer1_w_size + c + l2];
-          if (f <= -MAX_EXP) continue;
-          else if (f >= MAX_EXP) continue;
-          else f = expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))];
-          // 'g' is the gradient multiplied by the learning rate
-          g = (1 - vocab[word].code[d] - f) * alpha;
-          // Propagate errors output -> hidden
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1[c + l2];
-          // Learn weights hidden -> output
-          for (c = 0; c < layer1_w_size; c++) syn1[c + l2] += g * syn0_w[c + l1_w];
-          for (c = 0; c < layer1_l_size; c++) syn1[layer1_w_size + c + l2] += g * syn0_l[c + l1_l];
-        }
-        // NEGATIVE SAMPLING
-        if (negative > 0) for (d = 0; d < negative + 1; d++) {
-          if (d == 0) {
-            target = word;
-            label = 1;
-          } else {
-            next_random = next_random * (unsigned long long)25214903917 + 11;
-            target = table[(next_random >> 16) % table_size];
-            if (target == 0) target = next_random % (vocab_size - 1) + 1;
-            if (target == word) continue;
-            label = 0;
-          }
-          l2 = target * layer1_size;
-          f = 0; // dot product
-          for (c = 0; c < layer1_w_size; c++) f += syn0_w[c + l1_w] * syn1neg[c + l2];
-          for (c = 0; c < layer1_l_size; c++) f += syn0_l[c + l1_l] * syn1neg[layer1_w_size + c + l2];
-          if (f > MAX_EXP) g = (label - 1) * alpha;
-          else if (f < -MAX_EXP) g = (label - 0) * alpha;
-          else g = (label - expTable[(int)((f + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-          for (c = 0; c < layer1_size; c++) neu1e[c] += g * syn1neg[c + l2];
-          for (c = 0; c < layer1_w_size; c++) syn1neg[c + l2] += g * syn0_w[c + l1_w];
-          for (c = 0; c < layer1_l_size; c++) syn1neg[layer1_w_size + c + l2] += g * syn0_l[c + l1_l];
-        }
-        // Learn weights input -> hidden
-        for (c = 0; c < layer1_w_size; c++) syn0_w[c + l1_w] += neu1e[c];
-        for (c = 0; c < layer1_l_size; c++) syn0_l[c + l1_l] += neu1e[layer1_w_size + c];
+    for (r = 0; r < rows; r++) {
+      if (kmeans_cl[row[r]] != best[r]) kmeans_changed[t]++;
+      kmeans_cl[row[r]] = best[r];
+      counts[best[r]]++;
+      for (k = 0; k < layer1_size; k++) sums[best[r] * layer1_size + k] += kmeans_x[row[r] * layer1_size + k];
+    }
+  }
+  pthread_exit(NULL);
+}
+
+// Runs one assignment pass over kmeans_n rows (all words, or the mini-batch in kmeans_rows)
+// and folds the per-thread sums into the first thread's; returns how many rows changed class
+long long KMeansAssign() {
+  long long a, b, changed = 0;
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, KMeansAssignThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  for (a = 1; a < num_threads; a++) {
+    for (b = 0; b < classes * layer1_size; b++) kmeans_sums[b] += kmeans_sums[a * classes * layer1_size + b];
+    for (b = 0; b < classes; b++) kmeans_counts[b] += kmeans_counts[a * classes + b];
+  }
+  for (a = 0; a < num_threads; a++) changed += kmeans_changed[a];
+  free(pt);
+  return changed;
+}
+
+unsigned long long KMeansRandom(unsigned long long *next_random, unsigned long long range) {
+  *next_random = *next_random * (unsigned long long)25214903917 + 11;
+  return (*next_random >> 16) % range;
+}
+
+// Seeds the centroids with k-means++ on a random sample of KMEANS_SAMPLE words per class, which keeps
+// seeding at O(sample * classes) instead of a pass over the vocabulary per class; or with random words
+void KMeansSeed(unsigned long long *next_random) {
+  long long a, b, k, tmp, sample = KMEANS_SAMPLE * classes, *perm = (long long *)malloc(vocab_size * sizeof(long long));
+  double *d2, sum, pick, dist;
+  if (sample > vocab_size) sample = vocab_size;
+  // The sample is the head of a partial Fisher-Yates shuffle of the vocabulary
+  for (a = 0; a < vocab_size; a++) perm[a] = a;
+  for (a = 0; a < sample; a++) {
+    b = a + KMeansRandom(next_random, vocab_size - a);
+    tmp = perm[a];
+    perm[a] = perm[b];
+    perm[b] = tmp;
+  }
+  if (kmeans_init == KMEANS_RANDOM) {
+    for (k = 0; k < classes; k++) memcpy(&kmeans_cent[k * layer1_size], &kmeans_x[perm[k] * layer1_size], layer1_size * sizeof(real));
+    free(perm);
+    return;
+  }
+  d2 = (double *)malloc(sample * sizeof(double));
+  for (a = 0; a < sample; a++) d2[a] = 1e30;
+  b = perm[KMeansRandom(next_random, sample)];
+  for (k = 0; k < classes; k++) {
+    memcpy(&kmeans_cent[k * layer1_size], &kmeans_x[b * layer1_size], layer1_size * sizeof(real));
+    // Squared distance between unit vectors is 2 - 2 cos
+    sum = 0;
+    for (a = 0; a < sample; a++) {
+      dist = 2 - 2 * DotReal(&kmeans_x[perm[a] * layer1_size], &kmeans_cent[k * layer1_size], layer1_size);
+      if (dist < 0) dist = 0;
+      if (dist < d2[a]) d2[a] = dist;
+      sum += d2[a];
+    }
+    // The next seed is drawn with probability proportional to its squared distance to the closest one
+    pick = (KMeansRandom(next_random, 1ULL << 40) / (double)(1ULL << 40)) * sum;
+    for (a = 0; a < sample - 1; a++) {
+      pick -= d2[a];
+      if (pick < 0) break;
+    }
+    b = perm[a];
+  }
+  free(d2);
+  free(perm);
+}
+
+// Spherical K-means over the exported word rows (word vector and lemma average). Full passes assign
+// every word and move each centroid to the mean of its words; with -kmeans-batch each iteration only
+// assigns a random batch and moves the centroids with a per-centroid rate of 1 / words seen (Sculley's
+// mini-batch K-means). A last full pass gives the classes that are written out
+void RunKMeans(FILE *fo) {
+  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  long long a, b, k, changed, *seen = (long long *)calloc(classes, sizeof(long long));
+  unsigned long long next_random = 1;
+  real norm, rate;
+  double begin = GetTime();
+  if (classes > vocab_size) {
+    printf("WARNING: only %lld words, using as many classes\n", vocab_size);
+    classes = vocab_size;
+  }
+  kmeans_x = (real *)malloc(vocab_size * layer1_size * sizeof(real));
+  kmeans_cent = (real *)malloc(classes * layer1_size * sizeof(real));
+  kmeans_sums = (real *)malloc(num_threads * classes * layer1_size * sizeof(real));
+  kmeans_counts = (long long *)malloc(num_threads * classes * sizeof(long long));
+  kmeans_changed = (long long *)malloc(num_threads * sizeof(long long));
+  kmeans_cl = (int *)malloc(vocab_size * sizeof(int));
+  if (kmeans_x == NULL || kmeans_sums == NULL) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  for (a = 0; a < vocab_size; a++) kmeans_cl[a] = -1;
+  for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, KMeansRowsThread, (void *)a);
+  for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  KMeansSeed(&next_random);
+  if (kmeans_batch > 0) kmeans_rows = (long long *)malloc(kmeans_batch * sizeof(long long));
+  for (a = 0; a < kmeans_iter; a++) {
+    if (kmeans_batch > 0) {
+      kmeans_n = kmeans_batch;
+      for (b = 0; b < kmeans_batch; b++) kmeans_rows[b] = KMeansRandom(&next_random, vocab_size);
+    } else kmeans_n = vocab_size;
+    changed = KMeansAssign();
+    for (k = 0; k < classes; k++) {
+      if (kmeans_counts[k] == 0) {
+        // An empty class restarts from a random word unless a mini-batch merely missed it
+        if (kmeans_batch == 0) memcpy(&kmeans_cent[k * layer1_size], &kmeans_x[KMeansRandom(&next_random, vocab_size) * layer1_size],
+          layer1_size * sizeof(real));
+        continue;
       }
+      if (kmeans_batch > 0) {
+        seen[k] += kmeans_counts[k];
+        rate = (real)kmeans_counts[k] / seen[k];
+        for (b = 0; b < layer1_size; b++) kmeans_cent[k * layer1_size + b] = (1 - rate) * kmeans_cent[k * layer1_size + b] +
+          kmeans_sums[k * layer1_size + b] / seen[k];
+      } else memcpy(&kmeans_cent[k * layer1_size], &kmeans_sums[k * layer1_size], layer1_size * sizeof(real));
+      norm = sqrt(DotReal(&kmeans_cent[k * layer1_size], &kmeans_cent[k * layer1_size], layer1_size));
+      if (norm > 0) for (b = 0; b < layer1_size; b++) kmeans_cent[k * layer1_size + b] /= norm;
     }
-    sentence_position++;
-    if (sentence_position >= sentence_length) {
-      sentence_length = 0;
-      continue;
+    if (debug_mode > 1 && kmeans_batch == 0) printf("K-means iteration %lld: %.2f%% of the words changed class\n", a + 1, changed * 100.0 / vocab_size);
+    if (kmeans_batch == 0 && changed == 0) break;
+  }
+  if (kmeans_batch > 0) {
+    kmeans_n = vocab_size;
+    free(kmeans_rows);
+    kmeans_rows = NULL;
+    KMeansAssign();
+  }
+  if (debug_mode > 0) printf("Clustered %lld words into %lld classes in %.2fs\n", vocab_size, classes, GetTime() - begin);
+  // Save the K-means classes
+  for (a = 0; a < vocab_size; a++) fprintf(fo, "%s %d\n", vocab[a].word, kmeans_cl[a]);
+  free(kmeans_x);
+  free(kmeans_cent);
+  free(kmeans_sums);
+  free(kmeans_counts);
+  free(kmeans_changed);
+  free(kmeans_cl);
+  free(seen);
+  free(pt);
+}
+
+long long MemoryLine(const char *name, long long bytes, int print) {
+  if (print && bytes > 0) printf("  %-36s %10.1f MB\n", name, bytes / 1048576.0);
+  return bytes;
+}
+
+// Estimates the memory training will use with the current settings, structure by structure.
+// Matrices backed by -mmap-dir only count with their frequent rows, as the kernel can drop the rest
+long long EstimateMemory(int print) {
+  struct lemma_count *cursor;
+  long long a, strings = 0, nodes = 0, matrices, resident, total = 0, replicas = num_replicas > 0 ? num_replicas : 1;
+  long long hot = HotRows();
+  for (a = 0; a < vocab_size; a++) strings += strlen(vocab[a].word) + 1;
+  for (a = 0; a < lemmas_size; a++) strings += strlen(lemmas[a].lemma) + 1;
+  for (a = 0; a < vocab_size; a++) if (word_lemma_counts[a].lemma != -1)
+    for (cursor = word_lemma_counts[a].next; cursor != NULL; cursor = cursor->next) nodes++;
+  matrices = (vocab_size * layer1_w_size + lemmas_size * layer1_l_size) * sizeof(real);
+  if (negative > 0) matrices += vocab_size * layer1_size * sizeof(real);
+  if (hs) matrices += vocab_size * layer1_size * sizeof(real);
+  resident = matrices;
+  if (mmap_dir[0] != 0) {
+    resident = (hot * layer1_w_size + lemmas_size * layer1_l_size) * sizeof(real);
+    if (negative > 0) resident += hot * layer1_size * sizeof(real);
+    if (hs) resident += hot * layer1_size * sizeof(real);
+  }
+  if (print) printf("Memory estimate:\n");
+  total += MemoryLine("word and lemma hash tables", 2LL * vocab_hash_size * sizeof(int), print);
+  total += MemoryLine("vocabulary and lemmas", vocab_max_size * (sizeof(struct vocab_word) + sizeof(long long)) +
+    lemmas_max_size * sizeof(struct lemma_struct) + strings, print);
+  total += MemoryLine("word-lemma counts", (vocab_size + nodes) * sizeof(struct lemma_count), print);
+  if (sample > 0) total += MemoryLine("subsampling thresholds", vocab_size * sizeof(unsigned short), print);
+  total += MemoryLine(mmap_dir[0] ? "parameter matrices (frequent rows)" : "parameter matrices", resident, print);
+  total += MemoryLine("replicas", (replicas - 1) * resident, print);
+  if (sync_connect[0] != 0) total += MemoryLine("parameters as of the last exchange", resident, print);
+  if (hs) total += MemoryLine("Huffman codes and points", vocab_size * MAX_CODE_LENGTH * (sizeof(char) + sizeof(int)) +
+    (vocab_size * 2 + 1) * 3 * sizeof(long long), print);
+  if (negative > 0 && sampler == SAMPLER_TABLE) total += MemoryLine("unigram table", table_size * (long long)sizeof(int), print);
+  if (negative > 0 && sampler == SAMPLER_ALIAS) total += MemoryLine("alias sampler", vocab_size * (sizeof(unsigned int) + sizeof(int)), print);
+  total += MemoryLine("training threads", num_threads * (sizeof(struct thread_state) + 2 * layer1_size * sizeof(real) +
+    2 * (MAX_SENTENCE_LENGTH + 1) * sizeof(long long) + BUFSIZ), print);
+  if (tracing) total += MemoryLine("trace buffers", (num_threads + 3LL) * TRACE_EVENTS * sizeof(struct trace_event), print);
+  if (checkpoint_every > 0 || continue_file[0] != 0) total += MemoryLine("checkpoint buffer", CHECKPOINT_BUFFER, print);
+  if (classes > 0) total += MemoryLine("K-means rows, centroids and sums", (vocab_size + (num_threads + 1LL) * classes) * layer1_size * sizeof(real) +
+    vocab_size * sizeof(int), print);
+  total += MemoryLine("exp table", (EXP_TABLE_SIZE + 1) * sizeof(real), print);
+  if (print) {
+    printf("  %-36s %10.1f MB\n", "total", total / 1048576.0);
+    if (mmap_dir[0] != 0) printf("  %-36s %10.1f MB\n", "matrix files in -mmap-dir", matrices * replicas / 1048576.0);
+  }
+  return total;
+}
+
+// Classifies the run by where the parameters touched most often can live
+void PrintThroughputClass() {
+  long long llc = sysconf(_SC_LEVEL3_CACHE_SIZE), ram = sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE), hot = HotRows();
+  long long hot_bytes = (hot * (layer1_w_size + (negative > 0 ? layer1_size : 0)) + lemmas_size * layer1_l_size) * sizeof(real);
+  long long matrices = (vocab_size * (layer1_w_size + (negative > 0 ? layer1_size : 0)) + lemmas_size * layer1_l_size) * sizeof(real);
+  printf("Expected throughput class: ");
+  if (llc > 0 && hot_bytes <= llc) printf("cache-resident; the rows of the %.0f%% most frequent words fit in the %lld MB last-level cache, so SGD should be compute-bound\n",
+    HOT_ROW_SHARE * 100, llc >> 20);
+  else if (matrices <= ram) printf("DRAM-bound; the frequent rows (%.1f MB) exceed the last-level cache, so memory latency limits each thread\n", hot_bytes / 1048576.0);
+  else printf("out-of-core; the matrices (%.1f MB) exceed RAM, so page faults dominate unless -mmap-dir is on a fast SSD\n", matrices / 1048576.0);
+}
+
+// Makes the run fit max_memory before anything large is allocated: first the alias sampler
+// instead of the unigram table, then a single replica, then matrices backed by files next to
+// the output. Exits if even that is not enough, rather than failing later in training
+void FitMemoryBudget() {
+  char *slash;
+  if (EstimateMemory(0) <= max_memory) return;
+  if (negative > 0 && sampler == SAMPLER_TABLE) {
+    sampler = SAMPLER_ALIAS;
+    printf("To fit -max-memory: sampling negatives with the alias method instead of the unigram table\n");
+    if (EstimateMemory(0) <= max_memory) return;
+  }
+  if (num_replicas != 1 && !deterministic) {
+    num_replicas = 1;
+    printf("To fit -max-memory: training a single replica\n");
+    if (EstimateMemory(0) <= max_memory) return;
+  }
+  if (mmap_dir[0] == 0) {
+    strcpy(mmap_dir, output_file);
+    slash = strrchr(mmap_dir, '/');
+    if (slash != NULL) *slash = 0; else strcpy(mmap_dir, ".");
+    printf("To fit -max-memory: backing the matrices with files in %s\n", mmap_dir);
+    if (EstimateMemory(0) <= max_memory) return;
+  }
+  EstimateMemory(1);
+  printf("ERROR: training needs more than -max-memory %.1f MB\n", max_memory / 1048576.0);
+  exit(1);
+}
+
+// Sets up everything the training threads use: the parameters, the thread states, the replicas,
+// the subsampling thresholds and the negative sampler
+void InitTraining() {
+  double begin;
+  BeginPhase(PHASE_INIT_NET);
+  InitTopology();
+  InitNet();
+  EndPhase(PHASE_INIT_NET);
+  if (posix_memalign((void **)&thread_states, 64, num_threads * sizeof(struct thread_state)) != 0) {
+    printf("Memory allocation failed\n");
+    exit(1);
+  }
+  memset(thread_states, 0, num_threads * sizeof(struct thread_state));
+  if (continue_file[0] != 0) LoadPreviousModel();
+  if (resume) LoadCheckpoint();
+  if (num_replicas == 0) num_replicas = numa_nodes;
+  if (num_replicas > num_threads) num_replicas = num_threads;
+  if (deterministic) {
+    round_words = average_every / num_threads > 0 ? average_every / num_threads : 1;
+    rounds_per_epoch = train_words / num_threads / round_words + 1;
+    pthread_barrier_init(&round_barrier, NULL, num_threads);
+  }
+  begin = GetTime();
+  InitReplicas();
+  if (sample > 0) InitSubsampling();
+  TraceSpan(trace_main, "InitReplicas/InitSubsampling", begin);
+  BeginPhase(PHASE_UNIGRAM);
+  if (negative > 0 && sampler == SAMPLER_TABLE) InitUnigramTable();
+  if (negative > 0 && sampler == SAMPLER_ALIAS) InitAliasSampler();
+  EndPhase(PHASE_UNIGRAM);
+}
+
+// Sums up the progress every MONITOR_USEC for the given seconds, as MonitorTraining() does, so that the
+// averaging thread of an -autotune trial sees the words trained
+void AutotuneWait(double seconds) {
+  double end = GetTime() + seconds;
+  while (GetTime() < end) {
+    usleep(MONITOR_USEC);
+    SumProgress();
+  }
+}
+
+// Trains for autotune seconds with the current settings in a child process, so that the parameters
+// and matrix files of the real run stay untouched. Returns the training words per second after warm-up
+double AutotuneTrial() {
+  long long a, words;
+  double rate = 0, begin;
+  int fd[2], status;
+  pthread_t *pt, averaging_thread;
+  pid_t child;
+  if (pipe(fd) != 0) return 0;
+  fflush(stdout);
+  child = fork();
+  if (child == 0) {
+    close(fd[0]);
+    debug_mode = 0;
+    perf_counters = 0;
+    iter = 1000000;                     // Small corpora must not run out before the trial ends
+    InitTraining();
+    pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+    training_start = GetTime();
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+    // Replica candidates are timed with their averaging passes, as in the real run
+    if (num_replicas > 1 && !deterministic) pthread_create(&averaging_thread, NULL, AverageReplicasThread, NULL);
+    AutotuneWait(autotune * AUTOTUNE_WARMUP);
+    words = word_count_actual;
+    begin = GetTime();
+    AutotuneWait(autotune * (1 - AUTOTUNE_WARMUP));
+    rate = (word_count_actual - words) / (GetTime() - begin);
+    _exit(write(fd[1], &rate, sizeof(rate)) == sizeof(rate) ? 0 : 1);
+  }
+  close(fd[1]);
+  if (child == -1 || read(fd[0], &rate, sizeof(rate)) != sizeof(rate)) rate = 0;
+  close(fd[0]);
+  if (child > 0) waitpid(child, &status, 0);
+  return rate;
+}
+
+// Times the current settings unless they break -max-memory, and prints the result
+double AutotuneCandidate() {
+  double rate;
+  printf("  -threads %d -sampler %s -replicas %d: ", num_threads, sampler == SAMPLER_ALIAS ? "alias" : "table", num_replicas);
+  if (max_memory > 0 && EstimateMemory(0) > max_memory) {
+    printf("over -max-memory\n");
+    return 0;
+  }
+  rate = AutotuneTrial();
+  printf("%.2fk words/sec\n", rate / 1000);
+  return rate;
+}
+
+// Replaces the thread count, the negative sampler and the replica count by the fastest measured
+// on the training data: first the thread count, over powers of two up to the available CPUs, then
+// the sampler and the replicas one at a time with the best thread count
+void Autotune() {
+  int cpus = AvailableCpus(debug_mode > 0), threads, best_threads, best_sampler = sampler, best_replicas = num_replicas;
+  double rate, best = 0;
+  num_threads = cpus;
+  InitTopology();
+  printf("Autotuning on %d CPU(s) and %d NUMA node(s), %.1fs per setting:\n", cpus, numa_nodes, autotune);
+  best_threads = cpus;
+  for (threads = 1; threads <= cpus; threads = threads * 2 > cpus && threads < cpus ? cpus : threads * 2) {
+    num_threads = threads;
+    rate = AutotuneCandidate();
+    if (rate > best) {
+      best = rate;
+      best_threads = threads;
     }
   }
-  fclose(fi);
-  free(neu1);
-  free(neu1e);
-  pthread_exit(NULL);
+  num_threads = best_threads;
+  if (negative > 0) {
+    sampler = best_sampler == SAMPLER_TABLE ? SAMPLER_ALIAS : SAMPLER_TABLE;
+    rate = AutotuneCandidate();
+    if (rate > best) {
+      best = rate;
+      best_sampler = sampler;
+    }
+    sampler = best_sampler;
+  }
+  if (numa_nodes > 1 && num_threads > 1) {
+    num_replicas = best_replicas == 1 ? 0 : 1;
+    rate = AutotuneCandidate();
+    if (rate > best) {
+      best = rate;
+      best_replicas = num_replicas;
+    }
+  }
+  num_replicas = best_replicas;
+  printf("Autotune chose -threads %d -sampler %s -replicas %d: %.2fk words/sec\n", num_threads,
+    sampler == SAMPLER_ALIAS ? "alias" : "table", num_replicas, best / 1000);
 }
 
 void TrainModel() {
-  long a, b, c, d;
+  long a;
   FILE *fo, *fo_l, *fo_num_l;
-  pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-  real *lemma_average = (real *)calloc(layer1_l_size, sizeof(real));
-  struct lemma_count* cursor;
-  double avg_denom;
-  long long lemma_index, num_lemmas;
+  pthread_t *pt, averaging_thread, sync_thread;
   printf("Starting training using file %s\n", train_file);
   starting_alpha = alpha;
-  if (read_vocab_file[0] != 0  && read_lemmas_file != 0) ReadVocabAndLemmas(); else LearnVocabLemmasFromTrainFile();
-  if (save_vocab_file[0] != 0 && save_lemmas_file != 0) SaveVocabAndLemmas();
+  BeginPhase(PHASE_VOCAB);
+  if (continue_file[0] != 0) ExtendVocabFromTrainFile();
+  else if (vocab_cache_file[0] != 0 && access(vocab_cache_file, R_OK) == 0) ReadVocabCache();
+  else {
+    if (read_vocab_file[0] != 0 && read_lemmas_file[0] != 0) ReadVocabAndLemmas(); else LearnVocabLemmasFromTrainFile();
+    if (vocab_cache_file[0] != 0) SaveVocabCache();
+  }
+  if (save_vocab_file[0] != 0 && save_lemmas_file[0] != 0) SaveVocabAndLemmas();
+  EndPhase(PHASE_VOCAB);
+  if (deterministic && count_lemmas_in_training) {
+    printf("ERROR: -deterministic needs the word-lemma counts of a vocabulary learned from the training file or a vocabulary cache\n");
+    exit(1);
+  }
+  if (max_memory > 0) FitMemoryBudget();
+  if (dry_run) {
+    EstimateMemory(1);
+    PrintThroughputClass();
+    return;
+  }
   if (output_file[0] == 0 || output_lemmas_file[0] == 0 || output_num_lemmas_file[0] == 0) {
     printf("Skipping model training because an output file was missing.\n");
     return;
   }
-  word_lemma_counts = (struct lemma_count *)calloc(vocab_size, sizeof(struct lemma_count));
-  for (a = 0; a < vocab_size; a++) word_lemma_counts[a].lemma = -1;
-  InitNet();
-  if (negative > 0) InitUnigramTable();
-  start = clock();
+  if (autotune > 0) Autotune();
+  // Each worker of a multi-process run trains on its share of the file
+  if (sync_connect[0] != 0) train_words /= num_workers;
+  InitTraining();
+  if (sync_connect[0] != 0) {
+    ConnectCoordinator();
+    InitSync();
+  }
+  if (debug_mode > 0) printf("Starting training %.2fs after launch\n", GetTime() - program_start);
+  training_start = GetTime();
+  BeginPhase(PHASE_TRAINING);
+  pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
   for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, TrainModelThread, (void *)a);
+  if (num_replicas > 1 && !deterministic) pthread_create(&averaging_thread, NULL, AverageReplicasThread, NULL);
+  if (sync_fd != -1) pthread_create(&sync_thread, NULL, SyncThread, NULL);
+  MonitorTraining();
   for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+  if (sync_fd != -1) pthread_join(sync_thread, NULL);
+  if (deterministic) {
+    if (debug_mode > 0) printf("Trained in %lld rounds of %lld words per thread\n", rounds_done, round_words);
+  } else if (num_replicas > 1) {
+    training_done = 1;
+    pthread_join(averaging_thread, NULL);
+    // The exported model is the mean of the replicas
+    AverageReplicas();
+    if (debug_mode > 0) printf("\nAveraged replicas %d times in %.2fs\n", averaging_rounds, averaging_time);
+  }
+  EndPhase(PHASE_TRAINING);
+  if (perf_counters && debug_mode > 0) PrintPerfCounters();
+  SyncMatrixFiles();
+  if (worker_id > 0) {
+    // All workers end with the same parameters after the last round; worker 0 saves them
+    if (debug_mode > 0) printf("Worker %d finished\n", worker_id);
+    WriteStats("done");
+    WriteTrace();
+    return;
+  }
+  if (checkpoint_every > 0 || continue_file[0] != 0) {
+    // The final checkpoint, together with the vocabulary cache, is what a later -continue starts from.
+    // The cache is replaced last so that a failed run leaves the previous pair usable
+    if (checkpoint_buffer == NULL) checkpoint_buffer = (char *)malloc(CHECKPOINT_BUFFER);
+    if (SaveCheckpoint() != 0) printf("WARNING: writing checkpoint %s failed\n", checkpoint_file);
+    else if (continue_file[0] != 0) SaveVocabCache();
+  }
+  BeginPhase(PHASE_EXPORT);
   fo = fopen(output_file, "wb");
   fo_num_l = fopen(output_num_lemmas_file, "wb");
   if (classes == 0) {
-    // Save the word vectors
-    fprintf(fo, "%lld %lld %lld\n", vocab_size, layer1_size, layer1_w_size);
-    for (a = 0; a < vocab_size; a++) {
-      fprintf(fo, "%s ", vocab[a].word);
-      fprintf(fo_num_l, "%s ", vocab[a].word);
-      if (binary) {
-        for (b = 0; b < layer1_w_size; b++) fwrite(&syn0_w[a * layer1_w_size + b], sizeof(real), 1, fo);
-        // want to average lemma vectors here
-        cursor = &word_lemma_counts[a];
-        avg_denom = 0;
-        num_lemmas = 0; 
-        for (b = 0; b < layer1_l_size; b++) lemma_average[b] = 0; 
-        while(cursor != NULL)
-        {
-            lemma_index = cursor->lemma;
-            for (b = 0; b < layer1_l_size; b++) lemma_average[b] += cursor->cn * syn0_l[lemma_index*layer1_l_size + b];
-            avg_denom += cursor->cn;
-            num_lemmas++;
-            cursor = cursor->next;
-        }
-	if (avg_denom != 0) {
-	  for (b = 0; b < layer1_l_size; b++) lemma_average[b] /= avg_denom;
-	}
-        for (b = 0; b < layer1_l_size; b++) fwrite(&lemma_average[b], sizeof(real), 1, fo);
-      }
-      else {
-        for (b = 0; b < layer1_w_size; b++) fprintf(fo, "%lf ", syn0_w[a * layer1_w_size + b]);
-        // want to average lemma vectors here
-        cursor = &word_lemma_counts[a];
-        avg_denom = 0;
-        num_lemmas = 0; 
-        for (b = 0; b < layer1_l_size; b++) lemma_average[b] = 0;  
-        while(cursor != NULL)
-        {
-            lemma_index = cursor->lemma;
-            for (b = 0; b < layer1_l_size; b++) lemma_average[b] += cursor->cn * syn0_l[lemma_index*layer1_l_size + b];
-            avg_denom += cursor->cn;
-            num_lemmas++;
-            cursor = cursor->next;
-        }
-
-        fprintf(fo_num_l, " %lld\n", num_lemmas);
-
-	if (avg_denom != 0) {
-	  for (b = 0; b < layer1_l_size; b++) lemma_average[b] /= avg_denom;
-	}
-        for (b = 0; b < layer1_l_size; b++) fprintf(fo, "%lf ", lemma_average[b]);
-      }
-      fprintf(fo, "\n");
-    }
+    // Save the word vectors, each followed by the average of its lemma vectors
+    InitReduction();
+    fprintf(fo, "%lld %lld %lld\n", vocab_size, export_size, export_w_size);
+    if (normalize) ComputeColumnStats();
+    if (output_npy_prefix[0] != 0) BeginNpyExport();
+    ExportRows(fo, fo_num_l, vocab_size, 0);
   } else {
-    // Run K-means on the word vectors
-    fprintf(stderr, "%s", "K-means is not implented yet\n");
-    exit(-1);
-    int clcn = classes, iter = 10, closeid;
-    int *centcn = (int *)malloc(classes * sizeof(int));
-    int *cl = (int *)calloc(vocab_size, sizeof(int));
-    real closev, x;
-    real *cent = (real *)calloc(classes * layer1_size, sizeof(real));
-    for (a = 0; a < vocab_size; a++) cl[a] = a % clcn;
-    for (a = 0; a < iter; a++) {
-      for (b = 0; b < clcn * layer1_size; b++) cent[b] = 0;
-      for (b = 0; b < clcn; b++) centcn[b] = 1;
-      for (c = 0; c < vocab_size; c++) {
-        for (d = 0; d < layer1_w_size; d++) cent[layer1_size * cl[c] + d] += syn0_w[c * layer1_w_size + d];
-        for (d = 0; d < layer1_l_size; d++) cent[layer1_size * cl[c] + d] += syn0_l[c * layer1_l_size + d];
-        centcn[cl[c]]++;
-      }
-      for (b = 0; b < clcn; b++) {
-        closev = 0;
-        for (c = 0; c < layer1_size; c++) {
-          cent[layer1_size * b + c] /= centcn[b];
-          closev += cent[layer1_size * b + c] * cent[layer1_size * b + c];
-        }
-        closev = sqrt(closev);
-        for (c = 0; c < layer1_size; c++) cent[layer1_size * b + c] /= closev;
-      }
-      for (c = 0; c < vocab_size; c++) {
-        closev = -10;
-        closeid = 0;
-        for (d = 0; d < clcn; d++) {
-          x = 0;
-          for (b = 0; b < layer1_w_size; b++) x += cent[layer1_size * d + b] * syn0_w[c * layer1_w_size + b];
-          for (b = 0; b < layer1_l_size; b++) x += cent[layer1_size * d + b] * syn0_l[c * layer1_l_size + b];
-          if (x > closev) {
-            closev = x;
-            closeid = d;
-          }
-        }
-        cl[c] = closeid;
-      }
-    }
-    // Save the K-means classes
-    for (a = 0; a < vocab_size; a++) fprintf(fo, "%s %d\n", vocab[a].word, cl[a]);
-    free(centcn);
-    free(cent);
-    free(cl);
+    // Run K-means on the word vectors, each followed by the average of its lemma vectors
+    RunKMeans(fo);
   }
   fclose(fo);
   fclose(fo_num_l);
@@ -950,20 +4436,16 @@ void TrainModel() {
   fo_l = fopen(output_lemmas_file, "wb");
   if (classes == 0) {
     // Save the lemmas vectors
-    fprintf(fo_l, "%lld %lld\n", lemmas_size, layer1_l_size);
-    for (a = 0; a < lemmas_size; a++) {
-      fprintf(fo_l, "%s ", lemmas[a].lemma);
-      if (binary) {
-        for (b = 0; b < layer1_l_size; b++) fwrite(&syn0_l[a * layer1_l_size + b], sizeof(real), 1, fo_l);
-      }
-      else {
-        for (b = 0; b < layer1_l_size; b++) fprintf(fo_l, "%lf ", syn0_l[a * layer1_l_size + b]);
-      }
-      fprintf(fo_l, "\n");
-    }
+    fprintf(fo_l, "%lld %lld\n", lemmas_size, export_l_size);
+    ExportRows(fo_l, NULL, lemmas_size, 1);
   }
   // Don't bother with else clause for now, might want to implement later 
   fclose(fo_l);
+  if (classes == 0 && output_model_file[0] != 0) SaveModelFile();
+  if (classes == 0 && output_npy_prefix[0] != 0) FinishNpyExport();
+  EndPhase(PHASE_EXPORT);
+  WriteStats("done");
+  WriteTrace();
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -980,6 +4462,7 @@ int ArgPos(char *str, int argc, char **argv) {
 
 int main(int argc, char **argv) {
   int i;
+  program_start = GetTime();
   if (argc == 1) {
     printf("WORD VECTOR estimation toolkit v 0.1c, modified to take in word:lemma\n\n");
     printf("Options:\n");
@@ -990,6 +4473,19 @@ int main(int argc, char **argv) {
     printf("\t\tUse <file> to save the resulting word vectors / word clusters\n");
     printf("\t-output-lemmas <file>\n");
     printf("\t\tUse <file> to save the resulting lemma vectors\n");
+    printf("\t-output-model <file>\n");
+    printf("\t\tAlso save words, lemmas, lemma averages and word-lemma weights to <file> in a single container\n");
+    printf("\t\tthat distance_morph can map directly\n");
+    printf("\t-quantize <int>\n");
+    printf("\t\tAdd int8 copies of the word vectors and lemma averages, scaled per row, to -output-model; distance_morph\n");
+    printf("\t\tand word-analogy then scan those and rescore the best candidates in float; default is 0 (off)\n");
+    printf("\t-reduce-word-size <int>\n");
+    printf("\t\tProject the saved word vectors onto their top <int> principal components; default is 0 (off)\n");
+    printf("\t-reduce-lemma-size <int>\n");
+    printf("\t\tProject the saved lemma vectors and lemma averages onto their top <int> principal components; default is 0 (off)\n");
+    printf("\t-output-npy <prefix>\n");
+    printf("\t\tAlso save the word rows as saved to -output, the lemma vectors and both vocabularies as .npy files\n");
+    printf("\t\tnamed <prefix>.*.npy, indexed by <prefix>.json, for np.load(mmap_mode='r') in the Python scripts\n");
     printf("\t-word-size <int>\n");
     printf("\t\tSet size of word vectors; default is 50\n");
     printf("\t-lemma-size <int>\n");
@@ -1013,10 +4509,19 @@ int main(int argc, char **argv) {
     printf("\t\tSet the starting learning rate; default is 0.025 for skip-gram and 0.05 for CBOW\n");
     printf("\t-classes <int>\n");
     printf("\t\tOutput word classes rather than word vectors; default number of classes is 0 (vectors are written)\n");
+    printf("\t-kmeans-iter <int>\n");
+    printf("\t\tRun at most <int> K-means iterations; default is 10\n");
+    printf("\t-kmeans-init <plusplus|random>\n");
+    printf("\t\tSeed the classes with k-means++ on a sample of %d words per class, or with random words; default is plusplus\n", KMEANS_SAMPLE);
+    printf("\t-kmeans-batch <int>\n");
+    printf("\t\tAssign only <int> random words per iteration (mini-batch K-means); default is 0 (all words)\n");
     printf("\t-debug <int>\n");
     printf("\t\tSet the debug mode (default = 2 = more info during training)\n");
     printf("\t-binary <int>\n");
     printf("\t\tSave the resulting vectors in binary moded; default is 0 (off)\n");
+    printf("\t-normalize <int>\n");
+    printf("\t\tStandardize each dimension of the saved word vectors to zero mean and unit variance like column_normalize.py (1)\n");
+    printf("\t\tand also scale each vector to unit length (2); default is 0 (off). Lemma and model files stay raw\n");
     printf("\t-save-vocab <file>\n");
     printf("\t\tThe vocabulary will be saved to <file>\n");
     printf("\t-save-lemmas <file>\n");
@@ -1025,6 +4530,86 @@ int main(int argc, char **argv) {
     printf("\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
     printf("\t-read-lemmas <file>\n");
     printf("\t\tThe lemmas will be read from <file>, not constructed from the training data\n");
+    printf("\t-vocab-cache <file>\n");
+    printf("\t\tMap the vocabulary, lemmas and word-lemma counts from the binary cache <file>; if it does not exist yet,\n");
+    printf("\t\tthey are learned from the training data and saved there\n");
+    printf("\t-vocab-memory <size>\n");
+    printf("\t\tCount the vocabulary within <size> bytes (suffix K, M or G) with a heavy-hitter table and a count-min\n");
+    printf("\t\tsketch instead of pruning it when the hash fills up; default is 0 (exact counting)\n");
+    printf("\t-count-shard <file>\n");
+    printf("\t\tOnly count words, lemmas and word-lemma pairs of the training data and save the raw counts to <file>\n");
+    printf("\t-merge-shards <file,file,...>\n");
+    printf("\t\tSum the given count shards, apply min-count and save the vocabulary to the file given by -vocab-cache\n");
+    printf("\t-numa <none|interleave|partition>\n");
+    printf("\t\tPlace the parameter matrices round robin over the NUMA nodes or in one block per node; default is none\n");
+    printf("\t-pin-threads <int>\n");
+    printf("\t\tPin training threads to CPUs, spread over the NUMA nodes; default is 0 (off)\n");
+    printf("\t-huge-pages <int>\n");
+    printf("\t\tBack the parameter matrices with transparent (1) or explicit (2) huge pages; default is 0 (off)\n");
+    printf("\t-mmap-dir <dir>\n");
+    printf("\t\tBack the parameter matrices with files in <dir>, e.g. on a local SSD, so they may exceed RAM; the files\n");
+    printf("\t\thold the trained matrices when training ends\n");
+    printf("\t-replicas <int>\n");
+    printf("\t\tTrain <int> copies of the parameters, thread t updating copy t %% <int>, and average them periodically;\n");
+    printf("\t\t0 means one per NUMA node; default is 1 (a single shared copy)\n");
+    printf("\t-average-every <int>\n");
+    printf("\t\tAverage the replicas every <int> training words; default is 1000000\n");
+    printf("\t-deterministic <int>\n");
+    printf("\t\tGive bit-identical results for the same -seed and -threads: every thread trains its own replica on a\n");
+    printf("\t\tfixed shard of whole lines, and the replicas are averaged every -average-every words; default is 0 (off)\n");
+    printf("\t-seed <int>\n");
+    printf("\t\tSeed of the initial parameters and of the random streams of the training threads; default is 0\n");
+    printf("\t-autotune <float>\n");
+    printf("\t\tTrain for <float> seconds with each of several thread counts, negative samplers and replica counts, up\n");
+    printf("\t\tto the CPUs the affinity mask and cgroup quota allow, then train with the fastest; default is 0 (off)\n");
+    printf("\t-coordinator <port>\n");
+    printf("\t\tDo not train, but coordinate the -workers workers of a multi-process run on TCP port <port>\n");
+    printf("\t-connect <host:port>\n");
+    printf("\t\tTrain as worker -worker-id of -workers on its share of the training data, exchanging parameter deltas\n");
+    printf("\t\twith the coordinator at <host:port>; all workers need the same vocabulary, and worker 0 saves the model\n");
+    printf("\t-workers <int>\n");
+    printf("\t\tNumber of worker processes of a multi-process run; default is 1\n");
+    printf("\t-worker-id <int>\n");
+    printf("\t\tPosition of this worker, from 0 to -workers - 1; default is 0\n");
+    printf("\t-sync-every <int>\n");
+    printf("\t\tExchange parameters every <int> words trained by each worker; default is 1000000\n");
+    printf("\t-staleness <int>\n");
+    printf("\t\tLet a worker train up to <int> exchanges ahead of the last completed one; default is 1\n");
+    printf("\t-sync-rows <int>\n");
+    printf("\t\tOnly exchange the <int> most frequent word rows until training ends; default is 0 (all rows)\n");
+    printf("\t-early-stop <float>\n");
+    printf("\t\tEnd training after an epoch that lowers the sampled negative sampling loss by less than this\n");
+    printf("\t\tfraction; default is 0 (off)\n");
+    printf("\t-sampler <table|alias>\n");
+    printf("\t\tDraw negative samples from the 400 MB unigram table or from alias tables of 8 bytes per word; default is table\n");
+    printf("\t-dry-run <int>\n");
+    printf("\t\tStop after the vocabulary is known and print the memory training would use; default is 0 (off)\n");
+    printf("\t-max-memory <size>\n");
+    printf("\t\tFit training into <size> bytes (suffix K, M or G) by switching to the alias sampler, a single replica and\n");
+    printf("\t\tmatrices backed by files next to the output, in that order; fail right away if that is not enough\n");
+    printf("\t-stats-file <file>\n");
+    printf("\t\tWrite training metrics as JSON to <file> during training and once it is done\n");
+    printf("\t-stats-every <float>\n");
+    printf("\t\tSeconds between writes of the stats file; default is 10\n");
+    printf("\t-perf-counters <int>\n");
+    printf("\t\tCount cycles, instructions, LLC and dTLB misses of the reading and SGD parts of each training thread\n");
+    printf("\t\twith perf_event_open and print them per epoch; default is 0 (off)\n");
+    printf("\t-trace <file>\n");
+    printf("\t\tWrite a timeline of the training phases and sampled per-thread activity to <file> as Chrome\n");
+    printf("\t\ttrace-event JSON, to be opened in chrome://tracing or Perfetto\n");
+    printf("\t-checkpoint <file>\n");
+    printf("\t\tSave checkpoints to <file>; default is the output file name followed by .ckpt\n");
+    printf("\t-checkpoint-every <float>\n");
+    printf("\t\tSnapshot the model and training progress every <float> minutes, pausing training only for a fork, and\n");
+    printf("\t\tonce more when training ends; default is 0 (off). Snapshots of -deterministic runs may include a few\n");
+    printf("\t\tsentences past the recorded positions\n");
+    printf("\t-resume <int>\n");
+    printf("\t\tContinue training from the checkpoint (needs the same vocabulary and -threads); default is 0 (off)\n");
+    printf("\t-continue <file>\n");
+    printf("\t\tContinue training the model of checkpoint <file> on the training data only; the vocabulary cache given by\n");
+    printf("\t\t-vocab-cache must be the one of that run and is extended with the new words and lemmas\n");
+    printf("\t-alpha-schedule <linear|constant>\n");
+    printf("\t\tDecay the learning rate linearly to zero over training or keep it constant; default is linear\n");
     printf("\t-cbow <int>\n");
     printf("\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
     printf("\nExamples:\n");
@@ -1038,6 +4623,16 @@ int main(int argc, char **argv) {
   save_lemmas_file[0] = 0;
   read_vocab_file[0] = 0;
   read_lemmas_file[0] = 0;
+  vocab_cache_file[0] = 0;
+  count_shard_file[0] = 0;
+  checkpoint_file[0] = 0;
+  continue_file[0] = 0;
+  mmap_dir[0] = 0;
+  output_model_file[0] = 0;
+  output_npy_prefix[0] = 0;
+  sync_connect[0] = 0;
+  stats_file[0] = 0;
+  trace_file[0] = 0;
   if ((i = ArgPos((char *)"-word-size", argc, argv)) > 0) layer1_w_size = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-lemma-size", argc, argv)) > 0) layer1_l_size = atoi(argv[i + 1]);
   layer1_size = layer1_w_size + layer1_l_size;
@@ -1046,23 +4641,137 @@ int main(int argc, char **argv) {
   if ((i = ArgPos((char *)"-save-lemmas", argc, argv)) > 0) strcpy(save_lemmas_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-vocab", argc, argv)) > 0) strcpy(read_vocab_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-read-lemmas", argc, argv)) > 0) strcpy(read_lemmas_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-vocab-cache", argc, argv)) > 0) strcpy(vocab_cache_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-count-shard", argc, argv)) > 0) strcpy(count_shard_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-merge-shards", argc, argv)) > 0) merge_shards = argv[i + 1];
   if ((i = ArgPos((char *)"-debug", argc, argv)) > 0) debug_mode = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-binary", argc, argv)) > 0) binary = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-normalize", argc, argv)) > 0) normalize = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-cbow", argc, argv)) > 0) cbow = atoi(argv[i + 1]);
   if (cbow) alpha = 0.05;
   if ((i = ArgPos((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-output", argc, argv)) > 0) strcpy(output_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-output-lemmas", argc, argv)) > 0) strcpy(output_lemmas_file, argv[i + 1]);
   if ((i = ArgPos((char *)"-output-num-lemmas", argc, argv)) > 0) strcpy(output_num_lemmas_file, argv[i+1]);
+  if ((i = ArgPos((char *)"-output-model", argc, argv)) > 0) strcpy(output_model_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-quantize", argc, argv)) > 0) quantize = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-reduce-word-size", argc, argv)) > 0) reduce_w_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-reduce-lemma-size", argc, argv)) > 0) reduce_l_size = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-output-npy", argc, argv)) > 0) strcpy(output_npy_prefix, argv[i + 1]);
   if ((i = ArgPos((char *)"-window", argc, argv)) > 0) window = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-sample", argc, argv)) > 0) sample = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-hs", argc, argv)) > 0) hs = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-negative", argc, argv)) > 0) negative = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-iter", argc, argv)) > 0) iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sampler", argc, argv)) > 0) {
+    if (!strcmp(argv[i + 1], "table")) sampler = SAMPLER_TABLE;
+    else if (!strcmp(argv[i + 1], "alias")) sampler = SAMPLER_ALIAS;
+    else {
+      printf("Unknown sampler %s\n", argv[i + 1]);
+      exit(1);
+    }
+  }
+  if ((i = ArgPos((char *)"-dry-run", argc, argv)) > 0) dry_run = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-max-memory", argc, argv)) > 0) max_memory = ParseMemorySize(argv[i + 1]);
+  if ((i = ArgPos((char *)"-stats-file", argc, argv)) > 0) strcpy(stats_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-stats-every", argc, argv)) > 0) stats_every = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-perf-counters", argc, argv)) > 0) perf_counters = atoi(argv[i + 1]);
+  if (perf_counters) {
+    i = OpenPerfCounters();
+    if (i == -1) {
+      printf("WARNING: hardware counters are not available (see /proc/sys/kernel/perf_event_paranoid); -perf-counters is ignored\n");
+      perf_counters = 0;
+    } else close(i);
+    perf_epochs = (unsigned long long *)calloc(iter * 2 * PERF_COUNTERS, sizeof(unsigned long long));
+  }
+  if ((i = ArgPos((char *)"-trace", argc, argv)) > 0) strcpy(trace_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-early-stop", argc, argv)) > 0) early_stop = atof(argv[i + 1]);
   if ((i = ArgPos((char *)"-min-count", argc, argv)) > 0) min_count = atoi(argv[i + 1]);
   if ((i = ArgPos((char *)"-classes", argc, argv)) > 0) classes = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-kmeans-iter", argc, argv)) > 0) kmeans_iter = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-kmeans-init", argc, argv)) > 0) {
+    if (!strcmp(argv[i + 1], "plusplus")) kmeans_init = KMEANS_PLUSPLUS;
+    else if (!strcmp(argv[i + 1], "random")) kmeans_init = KMEANS_RANDOM;
+    else {
+      printf("Unknown K-means initialization %s\n", argv[i + 1]);
+      exit(1);
+    }
+  }
+  if ((i = ArgPos((char *)"-kmeans-batch", argc, argv)) > 0) kmeans_batch = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-numa", argc, argv)) > 0) {
+    if (!strcmp(argv[i + 1], "interleave")) numa_policy = NUMA_INTERLEAVE;
+    else if (!strcmp(argv[i + 1], "partition")) numa_policy = NUMA_PARTITION;
+    else if (!strcmp(argv[i + 1], "none")) numa_policy = NUMA_NONE;
+    else {
+      printf("Unknown NUMA policy %s\n", argv[i + 1]);
+      exit(1);
+    }
+  }
+  if ((i = ArgPos((char *)"-pin-threads", argc, argv)) > 0) pin_threads = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-huge-pages", argc, argv)) > 0) huge_pages = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-mmap-dir", argc, argv)) > 0) strcpy(mmap_dir, argv[i + 1]);
+  if (mmap_dir[0] != 0 && huge_pages) {
+    printf("WARNING: -huge-pages does not apply to matrices mapped from -mmap-dir\n");
+    huge_pages = 0;
+  }
+  if ((i = ArgPos((char *)"-checkpoint", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-checkpoint-every", argc, argv)) > 0) checkpoint_every = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-resume", argc, argv)) > 0) resume = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-continue", argc, argv)) > 0) strcpy(continue_file, argv[i + 1]);
+  if ((i = ArgPos((char *)"-alpha-schedule", argc, argv)) > 0) {
+    if (!strcmp(argv[i + 1], "linear")) alpha_schedule = ALPHA_LINEAR;
+    else if (!strcmp(argv[i + 1], "constant")) alpha_schedule = ALPHA_CONSTANT;
+    else {
+      printf("Unknown alpha schedule %s\n", argv[i + 1]);
+      exit(1);
+    }
+  }
+  if (checkpoint_file[0] == 0) sprintf(checkpoint_file, "%s.ckpt", output_file);
+  if ((i = ArgPos((char *)"-replicas", argc, argv)) > 0) num_replicas = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-average-every", argc, argv)) > 0) average_every = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-deterministic", argc, argv)) > 0) deterministic = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-autotune", argc, argv)) > 0) autotune = atof(argv[i + 1]);
+  if ((i = ArgPos((char *)"-seed", argc, argv)) > 0) seed = strtoull(argv[i + 1], NULL, 10);
+  if ((i = ArgPos((char *)"-coordinator", argc, argv)) > 0) sync_port = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-connect", argc, argv)) > 0) strcpy(sync_connect, argv[i + 1]);
+  if ((i = ArgPos((char *)"-workers", argc, argv)) > 0) num_workers = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-worker-id", argc, argv)) > 0) worker_id = atoi(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sync-every", argc, argv)) > 0) sync_every = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-staleness", argc, argv)) > 0) staleness = atoll(argv[i + 1]);
+  if ((i = ArgPos((char *)"-sync-rows", argc, argv)) > 0) sync_rows = atoll(argv[i + 1]);
+  if (sync_port == 0 && sync_connect[0] == 0) {
+    num_workers = 1;
+    worker_id = 0;
+  }
+  if (sync_connect[0] != 0 && (worker_id < 0 || worker_id >= num_workers)) {
+    printf("ERROR: -worker-id must be between 0 and %d\n", num_workers - 1);
+    exit(1);
+  }
+  if (sync_connect[0] != 0 && num_replicas != 1) {
+    printf("ERROR: -replicas cannot be combined with -connect\n");
+    exit(1);
+  }
+  // -deterministic output depends on the thread count and the sampler, which autotune picks by timing
+  if (autotune > 0 && (sync_connect[0] != 0 || resume || deterministic)) {
+    printf("ERROR: -autotune cannot be combined with -connect, -resume or -deterministic\n");
+    exit(1);
+  }
+  if (deterministic && (sync_connect[0] != 0 || resume || early_stop > 0)) {
+    printf("ERROR: -deterministic cannot be combined with -connect, -resume or -early-stop\n");
+    exit(1);
+  }
+  // Each thread trains its own replica, so the result does not depend on how the threads interleave
+  if (deterministic) num_replicas = num_threads;
+  if ((i = ArgPos((char *)"-vocab-memory", argc, argv)) > 0) vocab_memory = ParseMemorySize(argv[i + 1]);
+  if (vocab_memory > 0) {
+    // Size the hash tables so that the tables filling the budget stay 70% full
+    long long capacity = vocab_memory * 3 / 4 / BOUNDED_ENTRY_BYTES;
+    if (capacity < 1000) capacity = 1000;
+    if (capacity < vocab_hash_size * 0.7) vocab_hash_size = capacity / 0.7 + 1;
+  }
   vocab = (struct vocab_word *)calloc(vocab_max_size, sizeof(struct vocab_word));
+  vocab_cn = (long long *)calloc(vocab_max_size, sizeof(long long));
   lemmas = (struct lemma_struct *)calloc(lemmas_max_size, sizeof(struct lemma_struct));
   vocab_hash = (int *)calloc(vocab_hash_size, sizeof(int));
   lemma_hash = (int *)calloc(vocab_hash_size, sizeof(int));
@@ -1071,6 +4780,11 @@ int main(int argc, char **argv) {
     expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP); // Precompute the exp() table
     expTable[i] = expTable[i] / (expTable[i] + 1);                   // Precompute f(x) = x / (x + 1)
   }
-  TrainModel();
+  if (autotune > 0) trace_threads = AvailableCpus(0);
+  if (trace_file[0] != 0) InitTrace();
+  if (sync_port > 0) RunCoordinator();
+  else if (count_shard_file[0] != 0) SaveCountShard();
+  else if (merge_shards != NULL) MergeCountShards();
+  else TrainModel();
   return 0;
 }